@@ -2,6 +2,26 @@
 
 layout (local_size_x = 16, local_size_y = 16) in;
 
+/* Modes and features are selected by RendererCore::createShader, which inserts any of these after the #version line:
+ *  MODE_MIP            Maximum Intensity Projection instead of compositing
+ *  VIEW_TOP            Volume rotated to be viewed from the top
+ *  VIEW_BOTTOM         Volume rotated to be viewed from the bottom
+ *  ADAPTIVE_SAMPLING   Larger steps through transparent or homogeneous macrocells
+ *  PREINTEGRATION      Classify ray segments with the pre-integrated transfer function
+ *  VOLUME_FILTER_HW    Volume is a UNORM texture, trilinear filtering is done by the texture unit
+ *  VOLUME_FILTER_MANUAL Volume is an integer texture, trilinear filtering from 8 texelFetch taps
+ *  VOLUME_FILTER_CUBIC Volume holds normalized B-spline coefficients, tricubic filtering from 8 trilinear fetches
+ *  SHADING             Blinn-Phong shading of samples above shading_threshold, gradients from central differences
+ *  GRADIENT_VOLUME     Gradients are looked up in gradient_tex instead, only used together with SHADING
+ *  SHADOWS             Diffuse and specular light is attenuated by the light volume, only used together with SHADING
+ *  LIGHT_PASS          Builds one slice of the light volume instead of raymarching, see sweepLight
+ *  AMBIENT_OCCLUSION   Samples are darkened by the precomputed visibility in occlusion_tex
+ * Without a filter the integer volume is sampled nearest neighbour.
+ */
+#if defined(VIEW_TOP) || defined(VIEW_BOTTOM)
+    #define VIEW_ROTATED
+#endif
+
 struct Ray
 {
     vec4 origin;
@@ -19,13 +39,16 @@ struct AABB
 const float view_plane_dist = 1.733;
 const float EPSILON = 0.000001f;
 const float GAMMA = 2.2;
+const int MACROCELL_SIZE = 8;   // Must match MacrocellGrid::cell_size
+const float MAX_STEP_SCALE = 4.0;
 float x_ratio = 1.0, y_ratio = 1.0, z_ratio = 1.0;
+float step_jitter = 0.0;    // Offset of the first sample in units of the step size
 
 AABB bb = AABB(vec4(0,0,0,1), vec4(1,1,1,1));
 ivec3 vol_size;
 vec4 half_len = vec4(0,0,0,1);
 
-layout(binding = 1, std140) uniform Camera     //    16
+struct CameraState                            // Base Alignment      Aligned Offset
 {
     mat4 view_mat;                             //    16                 0   (c1)
                                                //    16                 16  (c2)
@@ -33,145 +56,542 @@ layout(binding = 1, std140) uniform Camera     //    16
                                                //    16                 48  (c4)
     vec4 eye;                                  //    16                 64
     float view_plane_dist;                     //    4                  80
-} main_cam;
+};
+
+// Must match RenderState in RenderState.h, one instance per frame slot.
+layout(binding = 1, std140) uniform RenderState
+{
+    CameraState main_cam;                      //    16                 0
+    vec4 voxel_size;                           //    16                 96
+    float alpha_scale;                         //    4                  112
+    float sampling_rate;                       //    4                  116
+    int min_val;                               //    4                  120
+    int max_val;                               //    4                  124
+    ivec2 target_size;                         //    8                  128   Reduced resolution rendered into the lower left corner
+    int accum_frame;                           //    4                  136   Frames blended into history_tex, -1 disables jitter and accumulation
+    float value_range;                         //    4                  140   Largest raw value, maps UNORM samples back to raw values
+    float shading_threshold;                   //    4                  144   Samples with less opacity are not shaded
+    vec4 light_dir;                            //    16                 160   World space direction towards the light
+    vec4 material;                             //    16                 176   Ambient, diffuse, specular, shininess
+    vec4 clip_planes[6];                       //    16                 192   World space normal and offset, dot(normal, p) > offset is clipped
+    vec4 crop_min;                             //    16                 288   Crop box as a fraction of bb along each axis
+    vec4 crop_max;                             //    16                 304
+    int num_clip_planes;                       //    4                  320
+};
 
-layout(location = 0) uniform float alpha_scale;
-layout(location = 1) uniform vec3 voxel_size;
-layout(location = 2) uniform int min_val;
-layout(location = 3) uniform int max_val;
-layout(location = 4) uniform int is_MIP;
-layout(location = 5) uniform int view_top;
-layout(location = 6) uniform int view_bottom;
+layout(location = 13) uniform ivec2 tile_offset;        // Pixel of the first dispatched workgroup, only the volume's screen bounds are dispatched
+layout(location = 14) uniform ivec3 light_sweep;        // Light pass: sweep axis, light direction on it (+1, -1), slice counted from the light
+layout(location = 15) uniform int use_reprojection;     // history_tex was rendered from another camera than this frame's
+layout(location = 16) uniform mat4 history_world_mat;   // World to view of the camera history_tex was rendered with
 
-layout(binding = 0, rgba32f) uniform image2D render_texture;
+layout(binding = 0) writeonly uniform image2D render_texture;   // RGBA32F, RGBA16F or RGBA8, no format needed for stores
+#if defined(VOLUME_FILTER_HW) || defined(VOLUME_FILTER_CUBIC)
+layout(binding = 1) uniform sampler3D vol_tex3D;
+#else
 layout(binding = 1) uniform usampler3D vol_tex3D;
+#endif
+layout(binding = 2) uniform usampler3D macrocell_tex;   // (min, max) of every MACROCELL_SIZE^3 block
+layout(binding = 3) uniform sampler2D preint_tex;       // (front, back) -> premultiplied RGBA of one ray segment
+layout(binding = 4) uniform sampler1D tf_tex;           // windowed value -> RGBA
+layout(binding = 5) uniform sampler2D history_tex;      // Last blended frame
+layout(binding = 9) uniform sampler2D opacity_range_tex;    // (low, high) windowed value bin -> (max, min) LUT opacity in between
+#if defined(SHADOWS) || defined(LIGHT_PASS)
+layout(binding = 7) uniform sampler3D light_tex;        // Transmittance towards the light at half resolution
+#endif
+#ifdef AMBIENT_OCCLUSION
+layout(binding = 8) uniform sampler3D occlusion_tex;    // Ambient visibility at half resolution
+#endif
+#ifdef LIGHT_PASS
+layout(binding = 1) writeonly uniform image3D light_image;   // light_tex, written one slice at a time
+#endif
+#ifdef GRADIENT_VOLUME
+layout(binding = 6) uniform sampler3D gradient_tex;     // Octahedral gradient direction in rg, sqrt(magnitude / value_range) in b
+#endif
+
+layout(binding = 0, std430) buffer SampleStats
+{
+    uint total_samples;
+    uint total_rays;
+} sample_stats;
+
+shared uint group_samples;
+shared uint group_rays;
 
+void setupBoundingBox();
+void sweepLight();
 void computeRay(float pixel_x, float pixel_y, int img_width, int img_height, out Ray eye_ray);
 bool intersectRayAABB(Ray ray, AABB bb, out float t_min, out float t_max);
-vec4 rayMarchVolume(Ray eye_ray, float t_min, float t_max);
-vec4 MIP(Ray eye_ray, float t_min, float t_max);
+bool clipRay(Ray ray, inout float t_min, inout float t_max);
+vec4 rayMarchVolume(Ray eye_ray, float t_min, float t_max, inout uint num_samples, out float t_rep);
+vec4 MIP(Ray eye_ray, float t_min, float t_max, inout uint num_samples);
+vec3 getJitter(ivec2 pix);
+vec4 accumulate(vec4 color, ivec2 pix, ivec2 img_size, vec4 rep_point);
 vec3 cartesianToTextureCoord(vec4 point);
+float applyWindow(float value);
+float correctOpacity(float alpha, float len_ratio);
+float sampleVolume(vec3 tex_coord);
+vec3 getGradient(vec3 tex_coord);
+vec3 textureToCartesianNormal(vec3 grad);
+vec4 shade(vec4 src, vec3 tex_coord, vec3 view_dir, float visibility);
+float getAdaptiveStep(uvec2 cell_range, ivec3 cell, vec3 tex_coord, vec3 tex_dir, float base_step);
+vec2 getCellOpacity(uvec2 cell_range);
+uvec2 getCellRange(vec3 tex_coord, out ivec3 cell);
+bool isCellEmpty(uvec2 cell_range);
+float getCellExit(ivec3 cell, vec3 tex_coord, vec3 tex_dir);
 
+#ifdef LIGHT_PASS
 void main()
 {
+    setupBoundingBox();
+    sweepLight();
+}
+#else
+void main()
+{
+    if(gl_LocalInvocationIndex == 0)
+    {
+        group_samples = 0;
+        group_rays = 0;
+    }
+    memoryBarrierShared();
+    barrier();
+
     ivec2 img_size = imageSize(render_texture);    
-    ivec2 pix = ivec2(gl_GlobalInvocationID.xy);
-    if (pix.x >= img_size.x || pix.y >= img_size.y)
-        return;
+    ivec2 pix = ivec2(gl_GlobalInvocationID.xy) + tile_offset;
+    uint num_samples = 0;
     
+    // No early return for pixels outside the image, every invocation has to reach the barrier below.
+    if (pix.x < target_size.x && pix.y < target_size.y)
+    {
+        setupBoundingBox();
+        
+        // Sub-pixel and first step offsets change every frame so the accumulated frames converge to the filtered image.
+        vec2 pix_offset = vec2(0.5);
+        if(accum_frame >= 0)
+        {
+            vec3 jitter = getJitter(pix);
+            pix_offset = jitter.xy;
+            step_jitter = jitter.z;
+        }
+        
+        Ray eye_ray;
+        vec2 pix_scale = vec2(img_size) / vec2(target_size);
+        computeRay((pix.x + pix_offset.x) * pix_scale.x, (pix.y + pix_offset.y) * pix_scale.y, img_size.x, img_size.y, eye_ray);
+        float t_max, t_min;
+        
+        // Point used for reprojection, where the ray becomes mostly opaque or the center depth for empty rays.
+        float t_rep = length(main_cam.eye.xyz);
+        vec4 color = vec4(0.0f);
+        // Cropping and clipping only shrink the ray interval, removed parts of the volume take no samples.
+        AABB crop_bb = AABB(mix(bb.p_min, bb.p_max, vec4(crop_min.xyz, 1.0)), mix(bb.p_min, bb.p_max, vec4(crop_max.xyz, 1.0)));
+        if(intersectRayAABB(eye_ray, crop_bb, t_min, t_max) && clipRay(eye_ray, t_min, t_max))
+        {
+#ifdef MODE_MIP
+            color = MIP(eye_ray, t_min, t_max, num_samples);
+#else
+            color = rayMarchVolume(eye_ray, t_min, t_max, num_samples, t_rep);
+#endif
+            atomicAdd(group_rays, 1u);
+        }
+        
+        if(accum_frame >= 0)
+            color = accumulate(color, pix, img_size, eye_ray.origin + eye_ray.dir * t_rep);
+        imageStore(render_texture, pix, color);
+    }
+    
+    // Reduce the sample counts per workgroup first so only one invocation per group touches the global counters.
+    atomicAdd(group_samples, num_samples);
+    memoryBarrierShared();
+    barrier();
+    if(gl_LocalInvocationIndex == 0 && group_rays > 0)
+    {
+        atomicAdd(sample_stats.total_samples, group_samples);
+        atomicAdd(sample_stats.total_rays, group_rays);
+    }
+}
+#endif
+
+void setupBoundingBox()
+{
     vol_size = textureSize(vol_tex3D,0);
     
     // Normalize Bounding box from arbitrary xyz size to 0 to aspect ratio range
     int max_dim = max(vol_size.x, vol_size.y);
     max_dim = max(max_dim, vol_size.z);
     
-    if(view_bottom == 1 || view_top == 1)
-        bb.p_max = vec4(vol_size.xzy, 1.0);
-    else
-        bb.p_max = vec4(vol_size.xyz, 1.0);
-    
-    bb.p_max /= max_dim;
-    
-    if(view_bottom == 1 || view_top == 1)
-        bb.p_max *= vec4(voxel_size.xzy,1.0);
-    else
-        bb.p_max *= vec4(voxel_size.xyz,1.0);
+#ifdef VIEW_ROTATED
+    bb.p_max = vec4(vol_size.xzy, 1.0) / max_dim * vec4(voxel_size.xzy,1.0);
+#else
+    bb.p_max = vec4(vol_size.xyz, 1.0) / max_dim * vec4(voxel_size.xyz,1.0);
+#endif
         
     //Align bounding box in the center of the screen.    
     half_len = vec4(bb.p_max.xyz/2.0, 0.0);  
     bb.p_min -= half_len;
     bb.p_max -= half_len;
+}
+
+#ifdef LIGHT_PASS
+/* One voxel of the current slice of the light volume. Light reaching it is the light reaching the previous slice, one
+ * step towards the light along the light direction, attenuated by the opacity of that step. The slice nearest to the
+ * light is fully lit. Lookups that leave the volume sideways see unattenuated light.
+ */
+void sweepLight()
+{
+    ivec3 light_size = imageSize(light_image);
+    int axis = light_sweep.x;
+    int u_axis = (axis + 1) % 3, v_axis = (axis + 2) % 3;
+    ivec3 voxel;
+    voxel[axis] = (light_sweep.y > 0) ? light_size[axis] - 1 - light_sweep.z : light_sweep.z;
+    voxel[u_axis] = int(gl_GlobalInvocationID.x);
+    voxel[v_axis] = int(gl_GlobalInvocationID.y);
+    if(voxel[u_axis] >= light_size[u_axis] || voxel[v_axis] >= light_size[v_axis])
+        return;
     
-    Ray eye_ray;
-    computeRay(pix.x + 0.5, pix.y + 0.5, img_size.x, img_size.y, eye_ray);
-    float t_max, t_min;
+    // World distance between two slices along the light direction and the texture space step covering it.
+    vec3 tex_dir = cartesianToTextureCoord(vec4(light_dir.xyz, 1.0)) - cartesianToTextureCoord(vec4(0.0, 0.0, 0.0, 1.0));
+    float step_len = 1.0 / (abs(tex_dir[axis]) * float(light_size[axis]));
+    vec3 tex_coord = (vec3(voxel) + 0.5) / vec3(light_size);
+    vec3 prev_coord = tex_coord + tex_dir * step_len;
     
-    if(intersectRayAABB(eye_ray, bb, t_min, t_max))
+    float transmittance = 1.0;
+    if(light_sweep.z > 0 && all(greaterThanEqual(prev_coord, vec3(0.0))) && all(lessThanEqual(prev_coord, vec3(1.0))))
     {
-        vec4 color;
-        if(is_MIP == 1)
-            color = MIP(eye_ray, t_min, t_max);
-        else
-            color = rayMarchVolume(eye_ray, t_min, t_max);
-        imageStore(render_texture, pix, color);
-    }
-    else
-    {
-        imageStore(render_texture, pix, vec4(0.0f));
+        float ref_step = length(bb.p_max.xyz - bb.p_min.xyz) / length(vol_size);
+        float n = textureSize(tf_tex, 0);
+        float alpha = texture(tf_tex, (applyWindow(sampleVolume(prev_coord)) * (n - 1.0) + 0.5) / n).a;
+        alpha = correctOpacity(alpha, step_len / ref_step);
+        transmittance = texture(light_tex, prev_coord).r * (1.0 - alpha);
     }
+    imageStore(light_image, voxel, vec4(transmittance));
 }
+#endif
 
-vec4 rayMarchVolume(Ray eye_ray, float t_min, float t_max)
+vec4 rayMarchVolume(Ray eye_ray, float t_min, float t_max, inout uint num_samples, out float t_rep)
 {    
-    float step_size;
-    vec4 start_point = eye_ray.origin + (eye_ray.dir * t_min);
-    vec4 end_point = eye_ray.origin + (eye_ray.dir * t_max);        
-    step_size = length(bb.p_max.xyz - bb.p_min.xyz) /  length(vol_size.xzy); 
+    // The reference step is one voxel, sampling_rate sets the number of samples per voxel.
+    float ref_step = length(bb.p_max.xyz - bb.p_min.xyz) /  length(vol_size.xzy); 
+    float base_step = ref_step / sampling_rate;
+    vec3 tex_dir = cartesianToTextureCoord(eye_ray.origin + eye_ray.dir) - cartesianToTextureCoord(eye_ray.origin);
     
     vec4 dest = vec4(0.0);
     vec4 src = vec4(0.0);
-    uvec4 sample_tex = uvec4(0);
-    vec4 pos = start_point + eye_ray.dir * EPSILON;  
-    for(int i = 0; i < 10000; i++)
+    float t = max(t_min, 0.0) + EPSILON + step_jitter * base_step;
+    t_rep = (max(t_min, 0.0) + t_max) * 0.5;
+    bool is_rep_found = false;
+    
+    // Value and distance of the previous sample, a negative value means there is no segment to integrate yet.
+    float s_front = -1.0, segment_len = base_step;
+    
+    // Every iteration advances by at least base_step so this bounds the loop for any volume size.
+    int max_steps = int(ceil((t_max - t) / base_step)) + 1;
+    for(int i = 0; i < max_steps && t < t_max; i++)
     {
-        vec3 tex_coord = cartesianToTextureCoord(pos);        
-        if( any(greaterThan(tex_coord, vec3(1.0))) || any(lessThan(tex_coord, vec3(0.0))) || dest.a >= 0.95)
-            break;
+        vec3 tex_coord = cartesianToTextureCoord(eye_ray.origin + eye_ray.dir * t);        
         
-        src = vec4(texture(vol_tex3D, tex_coord).r);
-        src = clamp(src, vec4(min_val), vec4(max_val)); 
-        if(src.a <= max_val && src.a >= min_val)
-            src = (src - min_val) /(max_val - min_val);       
+        /* Jump over fully transparent macrocells staying on the sampling grid. The first sample after the jump starts a
+         * new segment, like the first sample of the ray, instead of integrating from a value before the jump.
+         */
+        ivec3 cell;
+        uvec2 cell_range = getCellRange(tex_coord, cell);
+        if(isCellEmpty(cell_range))
+        {
+            t += base_step * max(ceil(getCellExit(cell, tex_coord, tex_dir) / base_step), 1.0);
+            s_front = -1.0;
+            segment_len = base_step;
+            continue;
+        }
+        
+        float s_back = applyWindow(sampleVolume(tex_coord));
+        num_samples++;
+        
+#ifdef ADAPTIVE_SAMPLING
+        float step_size = getAdaptiveStep(cell_range, cell, tex_coord, tex_dir, base_step);
+#else
+        float step_size = base_step;
+#endif
         
-        /** We can set colors manually for a range of isovalues after visualizing the histogram like so (x and y are the control points)
-            if(src.r * 255.0 >= x && src.r *255.0 <= y)
-                src.rgb = vec3(color.x, color.y, color.z);            
-        */
-        src.a *= alpha_scale;            
+#ifdef PREINTEGRATION
+        // The table holds the segment between the previous and this sample for a length of ref_step.
+        float n = textureSize(preint_tex, 0).x;
+        vec2 segment = vec2((s_front < 0.0) ? s_back : s_front, s_back);
+        src = texture(preint_tex, (segment * (n - 1.0) + 0.5) / n);
+        
+        float alpha = correctOpacity(src.a, segment_len / ref_step);
+        src.rgb *= (src.a > 0.0) ? alpha / src.a : 0.0;
+        src.a = alpha;
+        s_front = s_back;
+        segment_len = step_size;
+#else
+        float n = textureSize(tf_tex, 0);
+        src = texture(tf_tex, (s_back * (n - 1.0) + 0.5) / n);
+        src.a = correctOpacity(src.a, step_size / ref_step);
         src.rgb *= src.a;
+#endif
+        float visibility = 1.0;
+#ifdef AMBIENT_OCCLUSION
+        if(src.a > 0.0)
+            visibility = texture(occlusion_tex, tex_coord).r;
+#endif
+#ifdef SHADING
+        // Nearly transparent samples barely change the result, they skip the gradient fetches.
+        if(src.a > shading_threshold)
+            src = shade(src, tex_coord, -eye_ray.dir.xyz, visibility);
+        else
+            src.rgb *= visibility;
+#else
+        src.rgb *= visibility;
+#endif
         dest += src * (1 - dest.a);
         
-        if(dest.a > 0.99)
+        if(!is_rep_found && dest.a >= 0.5)
+        {
+            t_rep = t;
+            is_rep_found = true;
+        }
+        if(dest.a >= 0.95)
             break;
-        pos += eye_ray.dir * step_size;		
+        t += step_size;
     }
     return dest;
 }
 
-vec4 MIP(Ray eye_ray, float t_min, float t_max)
+vec4 MIP(Ray eye_ray, float t_min, float t_max, inout uint num_samples)
 {
-    float step_size;
-    vec4 start_point = eye_ray.origin + (eye_ray.dir * t_min);
-    vec4 end_point = eye_ray.origin + (eye_ray.dir * t_max);        
-    step_size = length(bb.p_max.xyz - bb.p_min.xyz) /  length(vol_size.xyz); 
+    float step_size = length(bb.p_max.xyz - bb.p_min.xyz) /  length(vol_size.xyz) / sampling_rate; 
+    vec3 tex_dir = cartesianToTextureCoord(eye_ray.origin + eye_ray.dir) - cartesianToTextureCoord(eye_ray.origin);
     
     vec4 dest = vec4(0.0);
     vec4 src = vec4(0.0);
-    uvec4 sample_tex = uvec4(0);
-    vec4 pos = start_point + eye_ray.dir * EPSILON; 
+    float t = max(t_min, 0.0) + EPSILON + step_jitter * step_size;
+    int max_steps = int(ceil((t_max - t) / step_size)) + 1;
     //MIP
-    for(int i = 0; i < 10000; i++)
+    for(int i = 0; i < max_steps && t < t_max; i++)
     {
-        vec3 tex_coord = cartesianToTextureCoord(pos);        
-        if( any(greaterThan(tex_coord, vec3(1.0))) || any(lessThan(tex_coord, vec3(0.0))) || dest.a >= 0.95)
+        vec3 tex_coord = cartesianToTextureCoord(eye_ray.origin + eye_ray.dir * t);        
+        if(dest.a >= 0.95)
             break;
         
-        src = vec4(texture(vol_tex3D, tex_coord).r);
-        src = clamp(src, vec4(min_val), vec4(max_val)); 
-        if(src.a <= max_val && src.a >= min_val)
-            src = (src - min_val) /(max_val - min_val);  
+        // Skip macrocells that are transparent or can't raise the current maximum.
+        ivec3 cell;
+        uvec2 cell_range = getCellRange(tex_coord, cell);
+        if(int(cell_range.y) <= min_val || applyWindow(float(cell_range.y)) * alpha_scale <= dest.a)
+        {
+            t += step_size * max(ceil(getCellExit(cell, tex_coord, tex_dir) / step_size), 1.0);
+            continue;
+        }
+        
+        src = vec4(applyWindow(sampleVolume(tex_coord)));
+        num_samples++;
         
         src *= alpha_scale;
         if(dest.a < src.a)
         {
             dest = src;                    
         }
-        pos += eye_ray.dir * step_size;
+        t += step_size;
     }
     
     return dest;
 }
 
+// pcg3d hash of the pixel and frame, three uniform random numbers in [0,1).
+vec3 getJitter(ivec2 pix)
+{
+    uvec3 v = uvec3(pix, accum_frame) * 1664525u + 1013904223u;
+    v.x += v.y * v.z;
+    v.y += v.z * v.x;
+    v.z += v.x * v.y;
+    v ^= v >> 16u;
+    v.x += v.y * v.z;
+    v.y += v.z * v.x;
+    v.z += v.x * v.y;
+    return vec3(v) * (1.0 / 4294967296.0);
+}
+
+/* Blends the new sample into the running average in history_tex. After a camera move the history is looked up where
+ * rep_point was seen by the camera it was rendered with, pixels that were off screen start over. Reprojected history
+ * gets the same short weight as the UI gives small camera moves, even if the frames in between were abandoned.
+ */
+vec4 accumulate(vec4 color, ivec2 pix, ivec2 img_size, vec4 rep_point)
+{
+    if(accum_frame == 0)
+        return color;
+    
+    vec2 prev_pix = vec2(pix) + 0.5;
+    if(use_reprojection == 1)
+    {
+        vec4 view_point = history_world_mat * rep_point;
+        if(view_point.z >= 0.0)
+            return color;
+        
+        float aspect_ratio = float(img_size.x) / img_size.y;
+        vec2 ndc = view_point.xy * main_cam.view_plane_dist / -view_point.z;
+        prev_pix = vec2((ndc.x / aspect_ratio + 1.0) * 0.5 * img_size.x, (ndc.y + 1.0) * 0.5 * img_size.y);
+        if(any(lessThan(prev_pix, vec2(0.0))) || any(greaterThanEqual(prev_pix, vec2(img_size))))
+            return color;
+    }
+    
+    vec4 history = texture(history_tex, prev_pix / vec2(img_size));
+    int history_frames = (use_reprojection == 1) ? min(accum_frame, 2) : accum_frame;
+    return mix(history, color, 1.0 / float(history_frames + 1));
+}
+
+// Raw value of the volume at tex_coord, the filtered paths return values between the integer voxel values.
+float sampleVolume(vec3 tex_coord)
+{
+#if defined(VOLUME_FILTER_HW)
+    return texture(vol_tex3D, tex_coord).r * value_range;
+#elif defined(VOLUME_FILTER_MANUAL)
+    // Same texel centers and edge clamping as GL_LINEAR with GL_CLAMP_TO_EDGE.
+    vec3 pos = tex_coord * vec3(vol_size) - 0.5;
+    vec3 f = fract(pos);
+    ivec3 p0 = ivec3(floor(pos));
+    ivec3 p1 = clamp(p0 + 1, ivec3(0), vol_size - 1);
+    p0 = clamp(p0, ivec3(0), vol_size - 1);
+    
+    float c000 = float(texelFetch(vol_tex3D, p0, 0).r);
+    float c100 = float(texelFetch(vol_tex3D, ivec3(p1.x, p0.y, p0.z), 0).r);
+    float c010 = float(texelFetch(vol_tex3D, ivec3(p0.x, p1.y, p0.z), 0).r);
+    float c110 = float(texelFetch(vol_tex3D, ivec3(p1.x, p1.y, p0.z), 0).r);
+    float c001 = float(texelFetch(vol_tex3D, ivec3(p0.x, p0.y, p1.z), 0).r);
+    float c101 = float(texelFetch(vol_tex3D, ivec3(p1.x, p0.y, p1.z), 0).r);
+    float c011 = float(texelFetch(vol_tex3D, ivec3(p0.x, p1.y, p1.z), 0).r);
+    float c111 = float(texelFetch(vol_tex3D, p1, 0).r);
+    
+    float c00 = mix(c000, c100, f.x), c10 = mix(c010, c110, f.x);
+    float c01 = mix(c001, c101, f.x), c11 = mix(c011, c111, f.x);
+    return mix(mix(c00, c10, f.y), mix(c01, c11, f.y), f.z);
+#elif defined(VOLUME_FILTER_CUBIC)
+    /* Sigg and Hadwiger's method, the 4 B-spline weights per axis are folded into 2 linear fetches whose positions
+     * between the texels give the weight ratios. 8 trilinear fetches instead of 64 texel reads.
+     */
+    vec3 pos = tex_coord * vec3(vol_size) - 0.5;
+    vec3 index = floor(pos);
+    vec3 f = pos - index;
+    vec3 one_f = 1.0 - f;
+    vec3 w0 = one_f * one_f * one_f / 6.0;
+    vec3 w1 = (4.0 - 6.0 * f * f + 3.0 * f * f * f) / 6.0;
+    vec3 w3 = f * f * f / 6.0;
+    vec3 w2 = 1.0 - w0 - w1 - w3;
+    
+    vec3 g0 = w0 + w1;
+    vec3 g1 = w2 + w3;
+    vec3 h0 = (index - 0.5 + w1 / g0) / vec3(vol_size);
+    vec3 h1 = (index + 1.5 + w3 / g1) / vec3(vol_size);
+    
+    float c000 = texture(vol_tex3D, h0).r;
+    float c100 = texture(vol_tex3D, vec3(h1.x, h0.y, h0.z)).r;
+    float c010 = texture(vol_tex3D, vec3(h0.x, h1.y, h0.z)).r;
+    float c110 = texture(vol_tex3D, vec3(h1.x, h1.y, h0.z)).r;
+    float c001 = texture(vol_tex3D, vec3(h0.x, h0.y, h1.z)).r;
+    float c101 = texture(vol_tex3D, vec3(h1.x, h0.y, h1.z)).r;
+    float c011 = texture(vol_tex3D, vec3(h0.x, h1.y, h1.z)).r;
+    float c111 = texture(vol_tex3D, h1).r;
+    
+    float c00 = g0.x * c000 + g1.x * c100, c10 = g0.x * c010 + g1.x * c110;
+    float c01 = g0.x * c001 + g1.x * c101, c11 = g0.x * c011 + g1.x * c111;
+    float c0 = g0.y * c00 + g1.y * c10, c1 = g0.y * c01 + g1.y * c11;
+    return (g0.z * c0 + g1.z * c1) * value_range;
+#else
+    return float(texture(vol_tex3D, tex_coord).r);
+#endif
+}
+
+// Gradient of the raw values per voxel, along the texture axes.
+vec3 getGradient(vec3 tex_coord)
+{
+#ifdef GRADIENT_VOLUME
+    // Inverse of GradientVolume::encode, the lower half of the octahedron is folded back.
+    vec3 packed = texture(gradient_tex, tex_coord).rgb;
+    vec2 oct = packed.xy * 2.0 - 1.0;
+    vec3 dir = vec3(oct, 1.0 - abs(oct.x) - abs(oct.y));
+    if(dir.z < 0.0)
+        dir.xy = (1.0 - abs(dir.yx)) * vec2(dir.x >= 0.0 ? 1.0 : -1.0, dir.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(dir) * packed.z * packed.z * value_range;
+#else
+    vec3 h = 1.0 / vec3(vol_size);
+    return 0.5 * vec3(sampleVolume(tex_coord + vec3(h.x, 0.0, 0.0)) - sampleVolume(tex_coord - vec3(h.x, 0.0, 0.0)),
+                      sampleVolume(tex_coord + vec3(0.0, h.y, 0.0)) - sampleVolume(tex_coord - vec3(0.0, h.y, 0.0)),
+                      sampleVolume(tex_coord + vec3(0.0, 0.0, h.z)) - sampleVolume(tex_coord - vec3(0.0, 0.0, h.z)));
+#endif
+}
+
+// Inverse of the axis mapping in cartesianToTextureCoord, also accounts for the voxel spacing of anisotropic volumes.
+vec3 textureToCartesianNormal(vec3 grad)
+{
+    grad *= vec3(vol_size);
+#if defined(VIEW_TOP)
+    grad = vec3(grad.x, grad.z, grad.y);
+#elif defined(VIEW_BOTTOM)
+    grad = vec3(grad.x, -grad.z, -grad.y);
+#else
+    grad.z = -grad.z;
+#endif
+    return grad / (2.0 * half_len.xyz);
+}
+
+/* Blinn-Phong on a premultiplied sample. Two sided, the normal is flipped towards the viewer since the gradient of a
+ * thin structure points either way. Homogeneous regions have no normal and only get the ambient visibility.
+ */
+vec4 shade(vec4 src, vec3 tex_coord, vec3 view_dir, float visibility)
+{
+    vec3 normal = textureToCartesianNormal(getGradient(tex_coord));
+    float len = length(normal);
+    if(len < EPSILON)
+        return vec4(src.rgb * visibility, src.a);
+    normal /= len;
+    if(dot(normal, view_dir) < 0.0)
+        normal = -normal;
+    
+    vec3 half_dir = normalize(light_dir.xyz + view_dir);
+    float diffuse = max(dot(normal, light_dir.xyz), 0.0);
+    float specular = (diffuse > 0.0) ? pow(max(dot(normal, half_dir), 0.0), material.w) : 0.0;
+#ifdef SHADOWS
+    float light = texture(light_tex, tex_coord).r;
+#else
+    float light = 1.0;
+#endif
+    src.rgb = src.rgb * (material.x * visibility + material.y * diffuse * light) + material.z * specular * light * src.a;
+    return src;
+}
+
+// Maps a raw value to 0-1, values outside [min_val, max_val] are clamped.
+float applyWindow(float value)
+{
+    return (clamp(value, float(min_val), float(max_val)) - min_val) / float(max_val - min_val);
+}
+
+/* Opacity of a segment len_ratio reference steps long through material with opacity alpha per reference step.
+ * alpha_scale scales the extinction so the pre-integrated and post-classified paths match, see updateOcclusion too.
+ */
+float correctOpacity(float alpha, float len_ratio)
+{
+    float exponent = len_ratio * alpha_scale;
+    return (exponent > 0.0) ? 1.0 - pow(max(1.0 - alpha, 0.0), exponent) : 0.0;
+}
+
+/* Larger steps through macrocells that are almost transparent or whose classified opacity barely changes. The narrow
+ * windowed range only confirms the latter, color and gradients can't vary much either then. A step never goes more than
+ * base_step past the end of the cell so the next, possibly detailed, cell is still entered at full rate.
+ */
+float getAdaptiveStep(uvec2 cell_range, ivec3 cell, vec3 tex_coord, vec3 tex_dir, float base_step)
+{
+    vec2 opacity = getCellOpacity(cell_range);
+    opacity = vec2(correctOpacity(opacity.x, 1.0), correctOpacity(opacity.y, 1.0));
+    float value_spread = applyWindow(float(cell_range.y)) - applyWindow(float(cell_range.x));
+    
+    float scale = 1.0;
+    if(opacity.x < 0.02)
+        scale = MAX_STEP_SCALE;
+    else if(opacity.x - opacity.y < 0.05 && value_spread < 0.2)
+        scale = (value_spread < 0.05) ? MAX_STEP_SCALE : 2.0;
+    
+    if(scale == 1.0)
+        return base_step;
+    return min(scale * base_step, max(getCellExit(cell, tex_coord, tex_dir), 0.0) + base_step);
+}
+
 vec3 cartesianToTextureCoord(vec4 point)
 {
     //Since the BB was aligned in the center we need to remap the coordinates back in 0-1 range
@@ -183,12 +603,48 @@ vec3 cartesianToTextureCoord(vec4 point)
      * when at the start of the bounding box
      */
     point.z = 1 - point.z; 
-    if(view_top == 1)
-        return vec3(point.x, 1 - point.z, point.y);
-    else if(view_bottom == 1)
-        return vec3(point.x, point.z, 1 - point.y);
-    else
-        return point.xyz;
+#if defined(VIEW_TOP)
+    return vec3(point.x, 1 - point.z, point.y);
+#elif defined(VIEW_BOTTOM)
+    return vec3(point.x, point.z, 1 - point.y);
+#else
+    return point.xyz;
+#endif
+}
+
+uvec2 getCellRange(vec3 tex_coord, out ivec3 cell)
+{
+    // Rays entering at a face can be slightly outside the volume from rounding, texelFetch must stay in bounds.
+    cell = clamp(ivec3(floor(tex_coord * vec3(vol_size))) / MACROCELL_SIZE, ivec3(0), textureSize(macrocell_tex, 0) - 1);
+    return texelFetch(macrocell_tex, cell, 0).rg;
+}
+
+/* A macrocell is empty if the transfer function has no opacity anywhere in its windowed value range. Values outside the
+ * window are clamped like the samples are, so a cell below the window minimum is only empty if the LUT is at 0.
+ */
+bool isCellEmpty(uvec2 cell_range)
+{
+    return getCellOpacity(cell_range).x <= 0.0;
+}
+
+// (max, min) of the LUT opacity over the windowed value range of a macrocell, bins are rounded outwards.
+vec2 getCellOpacity(uvec2 cell_range)
+{
+    float n = textureSize(opacity_range_tex, 0).x - 1;
+    ivec2 bins = ivec2(floor(applyWindow(float(cell_range.x)) * n), ceil(applyWindow(float(cell_range.y)) * n));
+    return texelFetch(opacity_range_tex, bins, 0).rg;
+}
+
+/* Distance along the ray from tex_coord to the exit of the macrocell. Since cartesianToTextureCoord is affine
+ * tex_dir, the ray direction in texture space, is constant for the whole ray.
+ */
+float getCellExit(ivec3 cell, vec3 tex_coord, vec3 tex_dir)
+{
+    vec3 cell_min = vec3(cell * MACROCELL_SIZE) / vol_size;
+    vec3 cell_max = vec3((cell + 1) * MACROCELL_SIZE) / vol_size;
+    vec3 t_exit = (mix(cell_min, cell_max, greaterThan(tex_dir, vec3(0.0))) - tex_coord) / tex_dir;
+    t_exit = mix(t_exit, vec3(1.0/0.0), equal(tex_dir, vec3(0.0)));
+    return min(t_exit.x, min(t_exit.y, t_exit.z));
 }
 
 void computeRay(float pixel_x, float pixel_y, int img_width, int img_height, out Ray eye_ray)
@@ -236,3 +692,26 @@ bool intersectRayAABB(Ray ray, AABB bb, out float t_min, out float t_max)
 	
     return(t_max > max(t_min, 0));
 }
+
+// Intersects the ray with the kept half space of every clip plane, false if nothing of the interval is left.
+bool clipRay(Ray ray, inout float t_min, inout float t_max)
+{
+    for(int i = 0; i < num_clip_planes; i++)
+    {
+        float denom = dot(clip_planes[i].xyz, ray.dir.xyz);
+        float dist = clip_planes[i].w - dot(clip_planes[i].xyz, ray.origin.xyz);
+        if(abs(denom) < EPSILON)
+        {
+            // Parallel to the plane, either entirely kept or entirely clipped.
+            if(dist < 0.0)
+                return false;
+            continue;
+        }
+        float t = dist / denom;
+        if(denom > 0.0)
+            t_max = min(t_max, t);
+        else
+            t_min = max(t_min, t);
+    }
+    return t_max > max(t_min, 0.0);
+}
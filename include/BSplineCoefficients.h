@@ -0,0 +1,28 @@
+#ifndef BSPLINECOEFFICIENTS_H
+#define BSPLINECOEFFICIENTS_H
+
+#include <cstdint>
+#include <vector>
+#include "glm/vec3.hpp"
+
+/* Coefficients of the cubic B-spline that interpolates the volume, normalized by value_range. Sampling them with a
+ * B-spline kernel reproduces the voxel values exactly at the voxel centers instead of blurring them. Computed with the
+ * recursive prefilter of Unser et al. along x, y and z, every axis is split into independent lines across threads.
+ */
+class BSplineCoefficients
+{
+    public:
+        BSplineCoefficients();
+        ~BSplineCoefficients();
+
+        void build(const std::vector<uint8_t>& volume_data, int datasize_bytes, glm::ivec3 volume_dim, float value_range);
+        void clear();
+
+        std::vector<float> coeffs;     // x varies fastest, same layout as the volume.
+        glm::ivec3 dim;
+
+    private:
+        static void prefilterLine(float* line, int n, size_t stride);
+};
+
+#endif // BSPLINECOEFFICIENTS_H
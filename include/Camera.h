@@ -3,8 +3,16 @@
 
 #include "glm/mat4x4.hpp"
 #include "glm/vec4.hpp"
+#include "glm/vec3.hpp"
+#include "glm/vec2.hpp"
 
-#include <vector>
+//std140 layout of the camera part of the shader's RenderState block.
+struct CameraState
+{
+    glm::mat4 view_mat;         // View to world
+    glm::vec4 eye;
+    float view_plane_dist, pad[3];
+};
 
 class Camera
 {
@@ -16,7 +24,8 @@ class Camera
         void resetCamera();
         void setOrientation(float zoom, float zenith, float azimuth);
         void setViewMatrix(glm::vec4 eye, glm::vec4 side, glm::vec4 up, glm::vec4 look_at);
-        void setUBO(std::vector<float>& cam_data);
+        void setUBO(CameraState& cam_state);
+        bool projectToScreen(glm::vec3 point, glm::ivec2 img_size, glm::vec2& pix);
         bool is_changed;
         glm::vec4 look_at;
         glm::vec4 side;
@@ -33,13 +33,16 @@ class GlfwManager
         void createWindow(int width, int height, std::string title, bool is_fullscreen = false);
         void focusWindow();
         void setCameraUpdateCallback(std::function<void(float, float, float)> cb);
+        void setFramebufferResizeCallback(std::function<void(int, int)> cb);
 
         GLFWwindow* window;
+        GLFWwindow* render_context;     // Hidden window whose context shares objects with the main one, used by the render thread.
         int window_width, window_height, framebuffer_width, framebuffer_height;
 
     private:
         void initImGui();
         static std::function<void(float, float, float)> cameraUpdateCallback;
+        static std::function<void(int, int)> framebufferResizeCallback;
 
         static void errorCallback(int error, const char* msg);
         static void framebufferSizeCallback(GLFWwindow* window, int width, int height);
@@ -0,0 +1,56 @@
+#ifndef GPUTIMER_H
+#define GPUTIMER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "glad/glad.h"
+
+/* Measures named GPU scopes with timestamp queries without stalling the pipeline. Queries of a frame are only read back
+ * once the ring has wrapped around to it again, results that still aren't available then are dropped.
+ */
+class GpuTimer
+{
+    public:
+        GpuTimer();
+        ~GpuTimer();
+
+        void begin(const std::string& scope);
+        void end(const std::string& scope);
+        void nextFrame();
+        float getAverage(const std::string& scope);
+        float getLatest(const std::string& scope);
+        void resetAverages();
+
+        static const int frames_in_flight = 4;
+
+    private:
+        struct Query
+        {
+            std::string scope;
+            GLuint start_ID, end_ID;
+        };
+
+        struct Frame
+        {
+            std::vector<GLuint> pool;       // Query objects owned by this slot, reused every time the ring wraps.
+            std::vector<Query> queries;
+            int used;
+        };
+
+        struct Average
+        {
+            double sum_ms;
+            int count;
+        };
+
+        GLuint getQuery();
+        void collect(Frame& frame);
+
+        Frame frames[frames_in_flight];
+        std::map<std::string, GLuint> open_scopes;
+        std::map<std::string, Average> averages;
+        int current_frame;
+};
+
+#endif // GPUTIMER_H
@@ -0,0 +1,45 @@
+#ifndef GRADIENTVOLUME_H
+#define GRADIENTVOLUME_H
+
+#include <cstdint>
+#include <vector>
+#include "glm/vec3.hpp"
+
+/* Gradients of the volume for shading and gradient based classification, so the raymarcher needs one fetch per sample
+ * instead of six. Every voxel takes 3 bytes, the gradient direction octahedrally encoded into two 8 bit components and
+ * the square root of its magnitude relative to value_range, which keeps more precision for the weak gradients.
+ * The volume is processed in slabs of slab_size slices, only one slab of results and its input slices are in memory.
+ */
+class GradientVolume
+{
+    public:
+        enum Kernel
+        {
+            KERNEL_CENTRAL,
+            KERNEL_SOBEL
+        };
+
+        GradientVolume();
+        ~GradientVolume();
+
+        void setup(const std::vector<uint8_t>& volume_data, int datasize_bytes, glm::ivec3 volume_dim, float value_range, int kernel);
+        int buildSlab(int z_begin);
+        void clear();
+
+        static const int slab_size = 16;
+        std::vector<uint8_t> slab;  // Result of the last buildSlab(), x varies fastest.
+        glm::ivec3 dim;
+
+    private:
+        void loadSlices(int z_begin, int z_end);
+        const float* getRow(int y, int z);
+        void computeRow(int y, int z, float* scratch, uint8_t* out);
+        static void encode(float gx, float gy, float gz, float inv_range, uint8_t* out);
+
+        const uint8_t* volume;
+        std::vector<float> values;  // Input slices of the current slab plus one on either side, clamped to the volume.
+        int datasize_bytes, values_z;
+        float inv_range, side_weight, center_weight, norm;
+};
+
+#endif // GRADIENTVOLUME_H
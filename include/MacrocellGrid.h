@@ -0,0 +1,32 @@
+#ifndef MACROCELLGRID_H
+#define MACROCELLGRID_H
+
+#include <cstdint>
+#include <vector>
+#include "glm/vec3.hpp"
+
+class BSplineCoefficients;
+
+/* Coarse grid storing the min/max voxel value of every cell_size^3 block of the volume. The raymarcher uses it to skip
+ * blocks that are fully transparent under the current window. With cubic filtering the ranges are those of the B-spline
+ * reconstruction instead, which can overshoot the voxel values.
+ */
+class MacrocellGrid
+{
+    public:
+        MacrocellGrid();
+        ~MacrocellGrid();
+
+        void build(const std::vector<uint8_t>& volume_data, int datasize_bytes, glm::ivec3 volume_dim);
+        void build(const BSplineCoefficients& bspline, float value_range);
+
+        static const int cell_size = 8;
+        std::vector<uint16_t> cells;   // Interleaved (min, max) pairs, x varies fastest.
+        glm::ivec3 grid_dim;
+
+    private:
+        template<typename ValueFunc>
+        void computeRanges(glm::ivec3 volume_dim, int overlap, ValueFunc value);
+};
+
+#endif // MACROCELLGRID_H
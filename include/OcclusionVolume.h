@@ -0,0 +1,57 @@
+#ifndef OCCLUSIONVOLUME_H
+#define OCCLUSIONVOLUME_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "glm/vec3.hpp"
+
+class MacrocellGrid;
+
+/* Local ambient occlusion of the classified volume at half resolution. Every voxel looks along 14 directions, 4 steps
+ * each, through the opacity of its neighbourhood and stores the average transmittance as 8 bit visibility. Computed on
+ * a background thread with parallelFor inside, the result is picked up with poll(). A transfer function change only
+ * recomputes the macrocells whose value range contains a changed opacity, plus their neighbours within the kernel.
+ */
+class OcclusionVolume
+{
+    public:
+        OcclusionVolume();
+        ~OcclusionVolume();
+
+        void setup(std::shared_ptr<const std::vector<uint8_t>> volume_data, int datasize_bytes, glm::ivec3 volume_dim, const MacrocellGrid& macrocells);
+        void update(const std::vector<float>& opacity);
+        bool poll(glm::ivec3& region_min, glm::ivec3& region_max);
+        void cancel();
+        bool isBusy();
+
+        static const int downsample = 2;
+        std::vector<uint8_t> visibility;    // x varies fastest, only read it after poll() returned true.
+        glm::ivec3 dim;
+        std::function<void()> on_done;      // Called on the worker thread once a job is ready to poll, may be empty.
+
+    private:
+        void compute();
+        void computeTransmittance(int cx, int cy, int cz);
+        void computeVisibility(int cx, int cy, int cz);
+        glm::ivec3 getCellMin(int cx, int cy, int cz);
+        glm::ivec3 getCellMax(int cx, int cy, int cz);
+        size_t getCellIndex(int cx, int cy, int cz);
+
+        std::shared_ptr<const std::vector<uint8_t>> volume_data;
+        int datasize_bytes;
+        glm::ivec3 volume_dim, grid_dim;
+        int cell_size;                      // Macrocell edge in occlusion voxels
+        std::vector<uint16_t> cell_ranges;  // Copy of the macrocell (min, max) pairs
+        std::vector<float> opacity;         // Raw value -> opacity of the last update
+        std::vector<uint8_t> transmittance; // Light passing one occlusion voxel along an axis, 0-255
+        std::vector<uint8_t> pending_cells, job_cells;   // Cells waiting for the next job and cells of the running one
+        glm::ivec3 job_min, job_max;
+        std::thread worker;
+        std::atomic<bool> cancel_job, is_done;
+};
+
+#endif // OCCLUSIONVOLUME_H
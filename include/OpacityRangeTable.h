@@ -0,0 +1,24 @@
+#ifndef OPACITYRANGETABLE_H
+#define OPACITYRANGETABLE_H
+
+#include <vector>
+#include "glm/vec2.hpp"
+#include "glm/vec4.hpp"
+
+/* 2D lookup table of (low bin, high bin) -> (max, min) opacity of a transfer function table over the windowed values
+ * between the two bins. It is built from every entry of the full resolution table, including the entries next to the
+ * range that linear filtering blends in, so narrow opacity spikes between bins are never missed.
+ */
+class OpacityRangeTable
+{
+    public:
+        OpacityRangeTable();
+        ~OpacityRangeTable();
+
+        void build(const std::vector<glm::vec4>& tf_table);
+
+        static const int size = 256;
+        std::vector<glm::vec2> table;   // size x size, x is the low bin and y the high bin, symmetric.
+};
+
+#endif // OPACITYRANGETABLE_H
@@ -0,0 +1,42 @@
+#ifndef PARALLELFOR_H
+#define PARALLELFOR_H
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+/* Splits the range [begin, end) into contiguous chunks, one per hardware thread, and calls func(chunk_begin, chunk_end)
+ * for each of them. Blocks until all chunks are done. Used for the load time and transfer function precomputations.
+ */
+template<typename Func>
+void parallelFor(int begin, int end, Func func)
+{
+    int count = end - begin;
+    if(count <= 0)
+        return;
+
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, count);
+    if(num_threads == 1)
+    {
+        func(begin, end);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1);
+    int chunk = (count + num_threads - 1) / num_threads;
+    for(int i = 1; i < num_threads; i++)
+    {
+        int chunk_begin = begin + i * chunk;
+        int chunk_end = std::min(end, chunk_begin + chunk);
+        if(chunk_begin < chunk_end)
+            threads.emplace_back(func, chunk_begin, chunk_end);
+    }
+    func(begin, std::min(end, begin + chunk));
+
+    for(int i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+#endif // PARALLELFOR_H
@@ -0,0 +1,28 @@
+#ifndef PREINTEGRATIONTABLE_H
+#define PREINTEGRATIONTABLE_H
+
+#include <vector>
+#include "glm/vec4.hpp"
+
+/* 2D lookup table of (front value, back value) -> premultiplied RGBA for a ray segment of one reference step, computed
+ * from a 1D transfer function table. Only the entries whose segment overlaps the changed part of the transfer function
+ * are recomputed on update().
+ */
+class PreIntegrationTable
+{
+    public:
+        PreIntegrationTable();
+        ~PreIntegrationTable();
+
+        bool update(const std::vector<glm::vec4>& tf_table);
+
+        std::vector<glm::vec4> table;   // size x size, x is the front value and y the back value.
+        int size, dirty_min, dirty_max; // Range of transfer function entries changed by the last update.
+
+    private:
+        std::vector<glm::vec4> transfer_func;
+        std::vector<float> extinction_integral;
+        std::vector<glm::vec3> color_integral;
+};
+
+#endif // PREINTEGRATIONTABLE_H
@@ -0,0 +1,32 @@
+#ifndef RENDERSTATE_H
+#define RENDERSTATE_H
+
+#include "glm/vec4.hpp"
+#include "glm/vec2.hpp"
+#include "Camera.h"
+
+/* Everything the shader reads per frame apart from the tile offset, laid out like the std140 RenderState block in
+ * VolumeRenderer.cs. Only 4 byte members in vec4 sized rows, so the C++ layout needs no extra padding.
+ */
+struct RenderState
+{
+    CameraState camera;
+    glm::vec4 voxel_size;
+    float alpha_scale, sampling_rate;
+    int min_val, max_val;       // Window in raw values, offset by 1000 for 16 bit data
+    glm::ivec2 target_size;     // Reduced resolution rendered into the lower left corner, stretched by the blit
+    int accum_frame;            // Frames already blended into history_tex, -1 disables jitter and accumulation
+    float value_range;          // Largest raw value, maps UNORM samples back to raw values
+    float shading_threshold;    // Samples with less opacity are not shaded
+    float pad[3];
+    glm::vec4 light_dir;        // World space direction towards the light
+    glm::vec4 material;         // Blinn-Phong ambient, diffuse and specular factors and the shininess
+    glm::vec4 clip_planes[6];   // World space normal and offset, points with dot(normal, p) > offset are clipped
+    glm::vec4 crop_min, crop_max;   // Crop box as a fraction of the bounding box along each world axis
+    int num_clip_planes;
+    float pad2[3];
+};
+
+static_assert(sizeof(RenderState) == 336, "RenderState must match the std140 layout of the shader block");
+
+#endif // RENDERSTATE_H
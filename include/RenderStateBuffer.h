@@ -0,0 +1,30 @@
+#ifndef RENDERSTATEBUFFER_H
+#define RENDERSTATEBUFFER_H
+
+#include "glad/glad.h"
+#include "RenderState.h"
+
+/* Uniform buffer with one RenderState per frame slot. The caller picks a slot the GPU isn't reading, only the 16 byte
+ * rows that differ from what that slot held before are written and flushed.
+ */
+class RenderStateBuffer
+{
+    public:
+        RenderStateBuffer();
+        ~RenderStateBuffer();
+
+        void setup();
+        void upload(int slot, const RenderState& state);
+        GLuint getBufferID();
+        GLintptr getOffset(int slot);
+
+        static const int num_slots = 3;
+
+    private:
+        GLuint ubo_ID;
+        GLintptr slot_stride;
+        RenderState slot_states[num_slots];    // Host copies of the slots, compared against to find the changed rows.
+        bool is_slot_valid[num_slots];
+};
+
+#endif // RENDERSTATEBUFFER_H
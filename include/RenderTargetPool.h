@@ -0,0 +1,34 @@
+#ifndef RENDERTARGETPOOL_H
+#define RENDERTARGETPOOL_H
+
+#include <vector>
+#include "glad/glad.h"
+#include "glm/vec2.hpp"
+
+/* Owns the 2D textures the volume is rendered into. Released textures are kept and handed out again when a target of
+ * the same size and format is requested, so switching formats or resizing back and forth doesn't reallocate.
+ */
+class RenderTargetPool
+{
+    public:
+        RenderTargetPool();
+        ~RenderTargetPool();
+
+        GLuint acquire(glm::ivec2 size, GLenum internal_format);
+        void release(GLuint tex_ID);
+        void trim(glm::ivec2 size);
+        void clear();
+
+    private:
+        struct Target
+        {
+            GLuint tex_ID;
+            glm::ivec2 size;
+            GLenum internal_format;
+            bool is_used;
+        };
+
+        std::vector<Target> targets;
+};
+
+#endif // RENDERTARGETPOOL_H
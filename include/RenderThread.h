@@ -0,0 +1,107 @@
+#ifndef RENDERTHREAD_H
+#define RENDERTHREAD_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "glad/glad.h"
+#include "GLFW/glfw3.h"
+#include "glm/vec2.hpp"
+#include "glm/vec3.hpp"
+#include "glm/mat4x4.hpp"
+#include "RenderStateBuffer.h"
+
+class GpuTimer;
+
+/* Runs the raymarch dispatches on a separate thread with its own GL context, shared with the UI context. Frames are
+ * requested through a single slot mailbox, a newer request replaces one that hasn't started yet. Requests and their
+ * RenderState live in one of RenderStateBuffer::num_slots preallocated slots, acquireSlot() returns one that is
+ * neither queued nor being rendered, so both can be written without locking or allocating. Frames alternate
+ * between two render targets and the UI thread always shows the last published one. A frame is split into tiles that
+ * are dispatched center-out in time-limited slices, the target is published after every slice.
+ */
+class RenderThread
+{
+    public:
+        struct Request
+        {
+            GLuint program_ID;
+            GLsync state_fence;     // Signaled once the UI thread's texture and RenderState updates for this frame are done.
+            glm::ivec2 tile_offset, workgroups, local_size;
+            float slice_budget_ms;  // GPU time per submitted slice of tiles.
+            glm::ivec2 target_size; // Pixels rendered at render_scale, the rest of the target stays empty.
+            float render_scale;     // Multiple of 1/256.
+            bool copy_history;
+            glm::mat4 world_mat;        // World to view of the frame's camera, kept as the history's camera once copied.
+            GLuint light_program_ID;    // Sweeps the light volume, 0 if no shadows are rendered.
+            int light_version;          // Incremented by the UI whenever the light volume is out of date.
+            glm::ivec3 light_size;
+            glm::ivec2 light_sweep;     // Axis the slices are swept along and the direction of the light on it (+1, -1).
+        };
+
+        //GL objects bound by the thread, all of them are owned by RendererCore.
+        struct Resources
+        {
+            GLuint targets[2], history_tex, vol_tex, gradient_tex, light_tex, occlusion_tex, macrocell_tex, preint_tex, tf_tex, opacity_range_tex, state_ubo, stats_ssbo;
+            GLintptr state_stride;  // Offset between the RenderState slots in state_ubo
+            glm::ivec2 target_size;
+            GLenum target_format;
+        };
+
+        RenderThread();
+        ~RenderThread();
+
+        void start(GLFWwindow* context, const Resources& res);
+        void stop();
+        int acquireSlot();
+        Request& getRequest(int slot);
+        void submit(int slot);
+        void waitIdle();
+        int beginBlit(float& render_scale);
+        void endBlit(GLsync fence);
+        bool isBusy();
+        int getFrontTarget();
+        float getFrontScale();
+        bool getFrameTime(float& gpu_ms, float& render_scale);
+        float getKernelTime();
+        float getLightTime();
+        void resetKernelTime();
+
+        std::atomic<float> samples_per_ray;
+        std::atomic<int> cancelled_frames;
+
+    private:
+        void run();
+        void renderFrame(int slot, GLuint clear_fbo, GpuTimer& gpu_timer);
+        void updateLightVolume(const Request& req, GpuTimer& gpu_timer);
+        void fenceSlot(int slot);
+        bool waitForGPU();
+
+        GLFWwindow* context;
+        Resources res;
+        std::thread thread;
+        std::mutex wake_mutex;
+        std::condition_variable wake_cv, idle_cv;
+        Request requests[RenderStateBuffer::num_slots];
+        std::atomic<GLsync> slot_fences[RenderStateBuffer::num_slots];    // Signaled once the GPU is done reading the slot's RenderState.
+        std::atomic<int> mailbox;         // Slot of the queued request, -1 if none.
+        std::atomic<int> active_slot;     // Slot of the request being rendered, -1 if idle.
+        int last_slot;                    // Slot submitted last, only used by the UI thread.
+        std::vector<glm::ivec2> tiles;
+        std::mutex blit_mutex;            // Held by the UI thread from reading the front target until its blit fence is stored.
+        GLsync blit_fences[2];            // Signaled once the UI thread's last blit of each target has read it.
+        int blit_target;                  // Target of the blit between beginBlit() and endBlit().
+        std::atomic<bool> is_stopping, is_kernel_reset;
+        std::atomic<int> front_info;      // Index of the last finished target in bit 0, its render scale * 256 above.
+        std::atomic<float> kernel_ms, light_ms;
+        int light_version;                // Version of the light volume last swept by this thread.
+        glm::mat4 history_world_mat;      // Camera of the last frame copied to history_tex, abandoned frames don't count.
+        float tile_ms;                    // Running estimate of the GPU time per tile, used to size the slices.
+        std::mutex timing_mutex;
+        float frame_ms, frame_scale;      // GPU time of the last frame's slices and the scale it was rendered at.
+        bool is_frame_timed;
+};
+
+#endif // RENDERTHREAD_H
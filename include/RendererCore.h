@@ -1,46 +1,169 @@
 #ifndef RENDERERCORE_H
 #define RENDERERCORE_H
 
+#include <map>
+#include <memory>
+#include <string>
 #include <vector>
+#include "glm/vec4.hpp"
 #include "glm/vec3.hpp"
 #include "glm/vec2.hpp"
+#include "BSplineCoefficients.h"
 #include "Camera.h"
+#include "GpuTimer.h"
+#include "GradientVolume.h"
+#include "MacrocellGrid.h"
+#include "OcclusionVolume.h"
+#include "OpacityRangeTable.h"
+#include "PreIntegrationTable.h"
+#include "RenderTargetPool.h"
+#include "RenderThread.h"
+#include "VolumeStatistics.h"
 
 class RendererCore
 {
     public:
         RendererCore();
         ~RendererCore();
-        void setup();
+        void setup(GLFWwindow* render_context);
+        void resize(int width, int height);
         void render();
+        bool updateStatistics();
+        bool updateOcclusion();
+        void updateSampleStats();
+        bool hasPendingWork();
+        void updateTransferFunction(const std::vector<glm::vec4>& tf_table);
 
     private:
         friend class RendererGUI;
+
+        //Features compiled into the shader with #defines, every combination is a separate program.
+        enum ShaderPermutation
+        {
+            SHADER_MIP = 1,
+            SHADER_VIEW_TOP = 2,
+            SHADER_VIEW_BOTTOM = 4,
+            SHADER_ADAPTIVE_SAMPLING = 8,
+            SHADER_PREINTEGRATION = 16,
+            SHADER_FILTER_HW = 32,
+            SHADER_FILTER_MANUAL = 64,
+            SHADER_FILTER_CUBIC = 128,
+            SHADER_SHADING = 256,
+            SHADER_GRADIENT_VOLUME = 512,
+            SHADER_SHADOWS = 1024,
+            SHADER_LIGHT_PASS = 2048,
+            SHADER_AMBIENT_OCCLUSION = 4096
+        };
+
+        //How the volume is reconstructed between voxels, also decides the texture format it is uploaded with.
+        enum VolumeFilter
+        {
+            FILTER_NEAREST,
+            FILTER_HARDWARE,
+            FILTER_MANUAL,
+            FILTER_CUBIC
+        };
+
+        //Clip plane as edited in the UI, orientation is one of the 6 axis directions or custom angles.
+        struct ClipPlane
+        {
+            bool is_enabled;
+            int orientation;
+            float azimuth, elevation;
+            float offset;           // Distance from the center as a fraction of the box extent along the normal
+        };
+
+        static const int max_clip_planes = 6;
+
+        //Where the shading gets its gradients from, computed per sample or looked up in a precomputed volume.
+        enum GradientSource
+        {
+            GRADIENT_CENTRAL,
+            GRADIENT_VOLUME
+        };
+
         void setAlpha();
         void setMinVal();
         void setMaxVal();
         void setMIP();
+        void setSamplingRate();
+        void setAdaptiveSampling();
+        void setPreIntegration();
+        void setVolumeFilter();
+        void setShading();
+        void setGradientKernel();
+        void setLighting();
+        void setOcclusion();
+        void setClipping();
+        void resetClipping();
+        void setRenderScale();
+        void updateDynamicScale();
+        glm::ivec2 getTargetSize(float scale);
         void setUniforms();
+        void applyUniforms();
         void setInitialCameraRotation();
         void setupFBO();
-        void setupUBO(bool is_update = false);
+        void setTargetFormat();
+        void startRenderThread();
+        void blitFBO();
+        void getScreenBounds(glm::ivec2& rect_min, glm::ivec2& rect_max);
         void readVolumeData(std::string fn);
+        void uploadVolume();
+        void uploadMacrocells();
+        void updateGradientVolume();
+        void setupLightVolume();
+        glm::vec3 getBoxHalfSize();
+        glm::ivec2 getLightSweep();
+        void applyStatistics(bool reset_window);
         bool checkRawInfFile(std::string fn);
         bool saveImage(std::string fn, std::string ext);
         bool loadShader(std::string fn, bool reload);
-        bool createShader(std::string fn, bool reload);
-        bool createShaderProgram();
+        bool readShaderFile(std::string& fn, bool reload);
+        bool createShader(const std::string& defines);
+        GLuint createShaderProgram();
+        GLuint buildProgram(int permutation);
+        std::string getProgramCacheFile(const std::string& defines);
+        void pruneProgramCache(const std::string& fn);
+        GLuint loadProgramBinary(const std::string& fn);
+        void saveProgramBinary(GLuint program_ID, const std::string& fn);
+        GLuint getProgram(int permutation);
+        bool selectProgram();
+        void clearProgramCache();
+        int getPermutation();
+        std::string getPermutationDefines(int permutation);
 
         Camera main_cam;
+        GpuTimer gpu_timer;
+        RenderState render_state;
+        RenderStateBuffer state_buffer;
+        RenderTargetPool target_pool;
+        RenderThread render_thread;
+        GLFWwindow* render_context;
+        VolumeStatistics volume_stats;
+        MacrocellGrid macrocells;
+        BSplineCoefficients bspline;
+        GradientVolume gradient_volume;
+        OcclusionVolume occlusion;
+        PreIntegrationTable preint_table;
+        OpacityRangeTable opacity_range;
+        std::shared_ptr<const std::vector<uint8_t>> volume_data;
         std::vector<float> histogram;
-        std::string loaded_dataset, loaded_shader, msg, title;
-        float alpha_scale, kerneltime_sum;
-        int workgroups_x, workgroups_y, datasize_bytes, min_val, max_val, max_dataset_val, min_dataset_val;
-        bool use_mip, rotate_to_bottom, rotate_to_top;
+        std::vector<glm::vec4> tf_lut, preint_source;
+        std::string loaded_dataset, loaded_shader, loaded_shader_path, shader_source, msg, title;
+        std::map<int, GLuint> program_cache;
+        float alpha_scale, sampling_rate, samples_per_ray, refine_delay, program_build_ms, prefilter_ms, gradient_ms, slice_budget_ms, render_scale, dynamic_scale, kernel_budget_ms;
+        float light_azimuth, light_elevation, shading_threshold;
+        double interaction_time;
+        int workgroups_x, workgroups_y, dispatched_x, dispatched_y, skipped_frames, interaction_scale, volume_filter, gradient_source, gradient_kernel, light_version, occlusion_version, accum_frame, max_accum_frames, datasize_bytes, min_val, max_val, max_dataset_val, min_dataset_val;
+        bool is_dirty, is_program_cached, is_gradient_valid, use_shading, use_shadows, use_occlusion, is_occlusion_valid, use_interaction_lowres, use_dynamic_res, use_temporal_accum, use_mip, use_adaptive_sampling, use_preintegration, rotate_to_bottom, rotate_to_top;
         glm::vec3 voxel_size;
-        glm::ivec3 tex3D_dim;
-        glm::ivec2 window_size, framebuffer_size;
-        GLuint vol_tex3D, camera_ubo_ID, fbo_ID, fbo_texID, cs_ID, cs_programID;
+        ClipPlane clip_planes[max_clip_planes];
+        glm::vec3 crop_min, crop_max;
+        glm::vec4 prev_eye, material;   // material holds the ambient, diffuse, specular factors and the shininess
+        glm::ivec3 tex3D_dim, light_size;
+        glm::ivec2 window_size, framebuffer_size, local_size;
+        GLenum target_format;
+        GLuint vol_tex3D, gradient_tex3D, light_tex3D, occlusion_tex3D, macrocell_tex3D, tf_tex1D, preint_tex2D, opacity_range_tex2D, stats_ssbo_ID, fbo_ID, render_targets[2], history_tex2D, cs_ID, cs_programID;
 };
 
 #endif // RENDERERCORE_H
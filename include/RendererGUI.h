@@ -37,10 +37,13 @@ class RendererGUI
         RendererCore volren;
         imgui_addons::ImGuiFileBrowser file_dialog;
         TransferFunction transfer_func;
+        std::vector<glm::vec4> tf_table;
         std::string error_msg, error_title;
-        float mspf, mspk;
+        float mspf, mspk, msp_blit, msp_ui, cpu_mspf;
+        int target_fps;
+        int skipped_fps, cancelled_fps;
         int workgroups_x, workgroups_y, profiler_wheight, tools_wheight;
-        bool profiler_shown, histogram_shown, tools_shown, HU_scale_shown, renderer_start;
+        bool low_power_idle, profiler_shown, histogram_shown, tools_shown, HU_scale_shown, renderer_start;
 };
 
 #endif // RENDERERGUI_H
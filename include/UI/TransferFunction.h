@@ -1,7 +1,7 @@
 #ifndef TRANSFERFUNCTION_H
 #define TRANSFERFUNCTION_H
 
-//#include "elements/GradientBarWidget.h"
+#include "elements/GradientBarWidget.h"
 #include "elements/AlphaControlSplineWidget.h"
 
 class TransferFunction
@@ -10,7 +10,9 @@ class TransferFunction
         TransferFunction();
         ~TransferFunction();
 
-        void render();
+        bool render();
+        void bakeTable(std::vector<glm::vec4>& table);
+        void setHistogram(const std::vector<float>& histogram, bool is_exact);
 
     private:
         enum class DataScale{
@@ -19,8 +21,10 @@ class TransferFunction
             ADAPTIVE_SCALE,
         };
         DataScale data_scale;
-        //GradientBarWidget grad_bar;
+        GradientBarWidget grad_bar;
         AlphaControlSplineWidget alpha_spline;
+        std::vector<float> histogram;
+        bool is_histogram_exact;
         int max_dataset_val;
         int min_medical_val;
         int convertValue(DataScale to_scale, int value);
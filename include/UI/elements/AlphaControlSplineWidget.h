@@ -16,7 +16,8 @@ class AlphaControlSplineWidget
 
         std::vector<CubicSpline::TransferFuncControlPoint> alpha_knots;
         CubicSpline::TransferFuncControlPoint* active_knot;
-        void render(float height, float width = 0.0);
+        bool render(float height, float width = 0.0);
+        float getOpacity(float iso_value);
 
     private:
         CubicSpline alpha_spline;
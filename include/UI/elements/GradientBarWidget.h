@@ -26,6 +26,7 @@ class GradientBarWidget
         ImGuiID knots_frameID;
 
         bool render(float knot_frame_height, float gradient_height, float width = 0.0f);
+        ImVec4 getColor(float value);
 
     private:
         float prev_width;
@@ -0,0 +1,53 @@
+#ifndef VOLUMESTATISTICS_H
+#define VOLUMESTATISTICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Computes the isovalue histogram and the min/max of a volume in two passes. A stratified random sample gives an
+ * approximate result within milliseconds so the UI can be used immediately, the exact result is then computed on a
+ * background thread and picked up with poll().
+ */
+class VolumeStatistics
+{
+    public:
+        VolumeStatistics();
+        ~VolumeStatistics();
+
+        void compute(std::shared_ptr<const std::vector<uint8_t>> volume_data, int datasize_bytes);
+        void cancel();
+        bool poll();
+        float getRefineProgress();
+
+        std::vector<float> histogram;
+        int min_value, max_value, sample_count;
+        float error_bound;  // Max. deviation of the sampled cumulative histogram from the exact one with 95% confidence.
+        bool is_exact;
+        std::function<void()> on_refined;   // Called on the background thread once poll() has a result, may be empty.
+
+    private:
+        struct Result
+        {
+            std::vector<float> histogram;
+            int min_value, max_value;
+        };
+
+        static int getVoxel(const uint8_t* data, int datasize_bytes, size_t idx);
+        static int getBin(int value, int datasize_bytes, int max_value);
+        static void normalizeHistogram(std::vector<float>& histogram);
+        void refine(std::shared_ptr<const std::vector<uint8_t>> volume_data, int datasize_bytes);
+        void setResult(Result& res);
+
+        std::thread refine_thread;
+        std::mutex result_mutex;
+        std::atomic<bool> cancel_refine, is_refined;
+        std::atomic<float> refine_progress;
+        Result refined_result;
+};
+
+#endif // VOLUMESTATISTICS_H
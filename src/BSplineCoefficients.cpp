@@ -0,0 +1,89 @@
+#include "BSplineCoefficients.h"
+#include "ParallelFor.h"
+
+#include <algorithm>
+#include <cmath>
+
+BSplineCoefficients::BSplineCoefficients() : dim(0, 0, 0)
+{
+    //ctor
+}
+
+BSplineCoefficients::~BSplineCoefficients()
+{
+    //dtor
+}
+
+void BSplineCoefficients::build(const std::vector<uint8_t>& volume_data, int datasize_bytes, glm::ivec3 volume_dim, float value_range)
+{
+    dim = volume_dim;
+    size_t slice_len = (size_t)dim.x * dim.y;
+    coeffs.resize(slice_len * dim.z);
+
+    const uint8_t* data8 = volume_data.data();
+    const uint16_t* data16 = (const uint16_t*) volume_data.data();
+    float scale = 1.0f / value_range;
+
+    //Rows along x are contiguous, the y and z passes walk lines with a stride but neighbouring lines share cache lines.
+    parallelFor(0, dim.z, [&](int z_begin, int z_end)
+    {
+        for(int z = z_begin; z < z_end; z++)
+        for(int y = 0; y < dim.y; y++)
+        {
+            size_t row = z * slice_len + (size_t)y * dim.x;
+            for(int x = 0; x < dim.x; x++)
+                coeffs[row + x] = ((datasize_bytes == 1) ? data8[row + x] : data16[row + x]) * scale;
+            prefilterLine(&coeffs[row], dim.x, 1);
+        }
+    });
+
+    parallelFor(0, dim.z, [&](int z_begin, int z_end)
+    {
+        for(int z = z_begin; z < z_end; z++)
+        for(int x = 0; x < dim.x; x++)
+            prefilterLine(&coeffs[z * slice_len + x], dim.y, dim.x);
+    });
+
+    parallelFor(0, dim.y, [&](int y_begin, int y_end)
+    {
+        for(int y = y_begin; y < y_end; y++)
+        for(int x = 0; x < dim.x; x++)
+            prefilterLine(&coeffs[(size_t)y * dim.x + x], dim.z, slice_len);
+    });
+}
+
+void BSplineCoefficients::clear()
+{
+    std::vector<float>().swap(coeffs);
+    dim = glm::ivec3(0, 0, 0);
+}
+
+/* Causal and anti-causal recursive filter with the single pole of the cubic B-spline and mirrored boundaries. The causal
+ * initial value is truncated once the pole's powers fall below float precision.
+ */
+void BSplineCoefficients::prefilterLine(float* line, int n, size_t stride)
+{
+    if(n < 2)
+        return;
+
+    const float pole = std::sqrt(3.0f) - 2.0f;
+    const float gain = (1.0f - pole) * (1.0f - 1.0f / pole);
+    const int horizon = std::min(n, 12);
+
+    for(int i = 0; i < n; i++)
+        line[i * stride] *= gain;
+
+    float sum = line[0], pole_n = pole;
+    for(int i = 1; i < horizon; i++)
+    {
+        sum += pole_n * line[i * stride];
+        pole_n *= pole;
+    }
+    line[0] = sum;
+    for(int i = 1; i < n; i++)
+        line[i * stride] += pole * line[(i - 1) * stride];
+
+    line[(n - 1) * stride] = (pole / (pole * pole - 1.0f)) * (pole * line[(n - 2) * stride] + line[(n - 1) * stride]);
+    for(int i = n - 2; i >= 0; i--)
+        line[i * stride] = pole * (line[(i + 1) * stride] - line[i * stride]);
+}
@@ -56,30 +56,31 @@ void Camera::setViewMatrix(glm::vec4 eye, glm::vec4 side, glm::vec4 up, glm::vec
     view2world_mat = glm::mat4(side, up, -look_at, eye);
 }
 
-void Camera::setUBO(std::vector<float>& cam_data)
+void Camera::setUBO(CameraState& cam_state)
 {
-    for(int i = 0; i < 21; i+=4)
-    {
-        if(i == 16)
-        {
-            cam_data.push_back(eye.x);
-            cam_data.push_back(eye.y);
-            cam_data.push_back(eye.z);
-            cam_data.push_back(1);
-
-            cam_data.push_back(this->view_plane_dist);
-            return;
-        }
-        glm::vec4 temp = glm::column(view2world_mat, i/4);
-        cam_data.push_back(temp.x);
-        cam_data.push_back(temp.y);
-        cam_data.push_back(temp.z);
-        cam_data.push_back(temp.w);
-    }
+    cam_state.view_mat = view2world_mat;
+    cam_state.eye = glm::vec4(eye.x, eye.y, eye.z, 1.0f);
+    cam_state.view_plane_dist = view_plane_dist;
     is_changed = false;
 }
 
 
+/* Pixel coordinates of a world space point in an image of img_size, the inverse of computeRay in the shader. Returns
+ * false if the point is not in front of the camera.
+ */
+bool Camera::projectToScreen(glm::vec3 point, glm::ivec2 img_size, glm::vec2& pix)
+{
+    glm::vec3 rel = point - glm::vec3(eye);
+    float depth = glm::dot(rel, glm::vec3(look_at));
+    if(depth <= 0.0001f)
+        return false;
+
+    float aspect_ratio = img_size.x / (float) img_size.y;
+    pix.x = (glm::dot(rel, glm::vec3(side)) * view_plane_dist / depth / aspect_ratio + 1.0f) * 0.5f * img_size.x;
+    pix.y = (glm::dot(rel, glm::vec3(up)) * view_plane_dist / depth + 1.0f) * 0.5f * img_size.y;
+    return true;
+}
+
 void Camera::setOrientation(float zoom , float zenith, float azimuth)
 {
     if(zenith == 0 && azimuth == 0)
@@ -7,6 +7,7 @@
 #include "imgui/imgui_impl_opengl3.h"
 
 std::function<void(float, float, float)> GlfwManager::cameraUpdateCallback;
+std::function<void(int, int)> GlfwManager::framebufferResizeCallback;
 
 GlfwManager::GlfwManager(int window_width, int window_height, std::string title, bool is_fullscreen)
 {
@@ -14,7 +15,7 @@ GlfwManager::GlfwManager(int window_width, int window_height, std::string title,
     if(!glfwInit())
         throw std::runtime_error("GLFW failed to initialize.");
 
-    window = NULL;
+    window = render_context = NULL;
     mouse_button_pressed = false;
     createWindow(window_width, window_height, title, is_fullscreen);
     initImGui();
@@ -27,6 +28,8 @@ GlfwManager::~GlfwManager()
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
 
+    if(render_context)
+        glfwDestroyWindow(render_context);
     if(window)
             glfwDestroyWindow(window);
         glfwTerminate();
@@ -55,7 +58,7 @@ void GlfwManager::createWindow(int window_width, int window_height, std::string
     glfwWindowHint(GLFW_DEPTH_BITS, 24);
 
     //Window Hints
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
     glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
 
     if(is_fullscreen)
@@ -82,6 +85,17 @@ void GlfwManager::createWindow(int window_width, int window_height, std::string
         throw std::runtime_error("Window creation failed..");
     }
 
+    //The render thread needs a context of its own, it is never shown so a 1x1 window is enough.
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    render_context = glfwCreateWindow(1, 1, "", NULL, window);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    if(!render_context)
+    {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        throw std::runtime_error("Render context creation failed..");
+    }
+
     glfwMakeContextCurrent(window);
     if( !gladLoadGLLoader( (GLADloadproc) glfwGetProcAddress) )
         throw std::runtime_error("Couldn't Initialize GLAD..");
@@ -135,6 +149,11 @@ void GlfwManager::setCameraUpdateCallback(std::function<void(float, float, float
     GlfwManager::cameraUpdateCallback = cb;
 }
 
+void GlfwManager::setFramebufferResizeCallback(std::function<void(int, int)> cb)
+{
+    GlfwManager::framebufferResizeCallback = cb;
+}
+
 void GlfwManager::errorCallback(int error, const char* msg)
 {
     std::cout << msg << std::endl;
@@ -142,6 +161,14 @@ void GlfwManager::errorCallback(int error, const char* msg)
 
 void GlfwManager::framebufferSizeCallback(GLFWwindow* window, int width, int height)
 {
+    GlfwManager* ptr = (GlfwManager*) glfwGetWindowUserPointer(window);
+    glfwGetWindowSize(window, &ptr->window_width, &ptr->window_height);
+    ptr->framebuffer_width = width;
+    ptr->framebuffer_height = height;
+    glViewport(0, 0, width, height);
+
+    if(framebufferResizeCallback)
+        framebufferResizeCallback(width, height);
 }
 
 void GlfwManager::keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -0,0 +1,115 @@
+#include "GpuTimer.h"
+
+const int GpuTimer::frames_in_flight;
+
+GpuTimer::GpuTimer()
+{
+    current_frame = 0;
+    for(int i = 0; i < frames_in_flight; i++)
+        frames[i].used = 0;
+}
+
+GpuTimer::~GpuTimer()
+{
+    for(int i = 0; i < frames_in_flight; i++)
+    {
+        if(!frames[i].pool.empty())
+            glDeleteQueries(frames[i].pool.size(), frames[i].pool.data());
+    }
+}
+
+GLuint GpuTimer::getQuery()
+{
+    Frame& frame = frames[current_frame];
+    if(frame.used == frame.pool.size())
+    {
+        GLuint query;
+        glGenQueries(1, &query);
+        frame.pool.push_back(query);
+    }
+    return frame.pool[frame.used++];
+}
+
+void GpuTimer::begin(const std::string& scope)
+{
+    GLuint query = getQuery();
+    glQueryCounter(query, GL_TIMESTAMP);
+    open_scopes[scope] = query;
+}
+
+void GpuTimer::end(const std::string& scope)
+{
+    std::map<std::string, GLuint>::iterator it = open_scopes.find(scope);
+    if(it == open_scopes.end())
+        return;
+
+    GLuint query = getQuery();
+    glQueryCounter(query, GL_TIMESTAMP);
+    frames[current_frame].queries.push_back({scope, it->second, query});
+    open_scopes.erase(it);
+}
+
+void GpuTimer::nextFrame()
+{
+    current_frame = (current_frame + 1) % frames_in_flight;
+    collect(frames[current_frame]);
+}
+
+//Reads back the oldest frame in the ring before its queries are reused.
+void GpuTimer::collect(Frame& frame)
+{
+    for(int i = 0; i < frame.queries.size(); i++)
+    {
+        GLint is_available = 0;
+        glGetQueryObjectiv(frame.queries[i].end_ID, GL_QUERY_RESULT_AVAILABLE, &is_available);
+        if(!is_available)
+            continue;
+
+        GLuint64 start_time = 0, end_time = 0;
+        glGetQueryObjectui64v(frame.queries[i].start_ID, GL_QUERY_RESULT, &start_time);
+        glGetQueryObjectui64v(frame.queries[i].end_ID, GL_QUERY_RESULT, &end_time);
+
+        Average& avg = averages[frame.queries[i].scope];
+        avg.sum_ms += (end_time - start_time) / 1000000.0;
+        avg.count++;
+    }
+    frame.queries.clear();
+    frame.used = 0;
+}
+
+/* Time of the last ended instance of the scope in the current frame, -1 if the GPU hasn't reached its end yet. Doesn't
+ * wait, meant for callers that already know the commands finished. The scope still counts towards the average.
+ */
+float GpuTimer::getLatest(const std::string& scope)
+{
+    const std::vector<Query>& queries = frames[current_frame].queries;
+    for(int i = (int) queries.size() - 1; i >= 0; i--)
+    {
+        if(queries[i].scope != scope)
+            continue;
+
+        GLint is_available = 0;
+        glGetQueryObjectiv(queries[i].end_ID, GL_QUERY_RESULT_AVAILABLE, &is_available);
+        if(!is_available)
+            return -1.0f;
+
+        GLuint64 start_time = 0, end_time = 0;
+        glGetQueryObjectui64v(queries[i].start_ID, GL_QUERY_RESULT, &start_time);
+        glGetQueryObjectui64v(queries[i].end_ID, GL_QUERY_RESULT, &end_time);
+        return (end_time - start_time) / 1000000.0;
+    }
+    return -1.0f;
+}
+
+float GpuTimer::getAverage(const std::string& scope)
+{
+    std::map<std::string, Average>::iterator it = averages.find(scope);
+    if(it == averages.end() || it->second.count == 0)
+        return 0.0f;
+    return it->second.sum_ms / it->second.count;
+}
+
+void GpuTimer::resetAverages()
+{
+    averages.clear();
+}
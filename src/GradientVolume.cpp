@@ -0,0 +1,174 @@
+#include "GradientVolume.h"
+#include "ParallelFor.h"
+
+#include <algorithm>
+#include <cmath>
+
+const int GradientVolume::slab_size;
+
+GradientVolume::GradientVolume() : dim(0, 0, 0)
+{
+    volume = nullptr;
+    datasize_bytes = 1;
+    values_z = 0;
+    inv_range = 1.0f;
+    side_weight = 0.0f;
+    center_weight = norm = 1.0f;
+}
+
+GradientVolume::~GradientVolume()
+{
+    //dtor
+}
+
+/* Both kernels are a derivative along one axis smoothed with (side, center, side) along the other two. Central
+ * differences are the special case without smoothing. norm scales the Sobel result to the same units, raw values per voxel.
+ */
+void GradientVolume::setup(const std::vector<uint8_t>& volume_data, int datasize_bytes, glm::ivec3 volume_dim, float value_range, int kernel)
+{
+    volume = volume_data.data();
+    this->datasize_bytes = datasize_bytes;
+    dim = volume_dim;
+    inv_range = 1.0f / value_range;
+    side_weight = (kernel == KERNEL_SOBEL) ? 1.0f : 0.0f;
+    center_weight = (kernel == KERNEL_SOBEL) ? 2.0f : 1.0f;
+    float smooth_sum = 2.0f * side_weight + center_weight;
+    norm = 0.5f / (smooth_sum * smooth_sum);
+}
+
+//Computes the slices [z_begin, z_begin + slab_size) into slab and returns how many there were.
+int GradientVolume::buildSlab(int z_begin)
+{
+    int z_end = std::min(z_begin + slab_size, dim.z);
+    if(z_begin >= z_end)
+        return 0;
+
+    loadSlices(z_begin, z_end);
+    slab.resize((size_t)dim.x * dim.y * (z_end - z_begin) * 3);
+
+    int num_rows = dim.y * (z_end - z_begin);
+    parallelFor(0, num_rows, [&](int row_begin, int row_end)
+    {
+        std::vector<float> scratch(6 * dim.x + 3 * (dim.x + 2) + 3 * dim.x);
+        for(int row = row_begin; row < row_end; row++)
+        {
+            int y = row % dim.y;
+            int z = z_begin + row / dim.y;
+            computeRow(y, z, scratch.data(), &slab[(size_t)row * dim.x * 3]);
+        }
+    });
+    return z_end - z_begin;
+}
+
+void GradientVolume::clear()
+{
+    std::vector<uint8_t>().swap(slab);
+    std::vector<float>().swap(values);
+    volume = nullptr;
+    dim = glm::ivec3(0, 0, 0);
+}
+
+//Raw values are converted once per slab so the row loops below only deal with floats.
+void GradientVolume::loadSlices(int z_begin, int z_end)
+{
+    values_z = std::max(z_begin - 1, 0);
+    int last_z = std::min(z_end, dim.z - 1);
+    size_t slice_len = (size_t)dim.x * dim.y;
+    values.resize(slice_len * (last_z - values_z + 1));
+
+    const uint8_t* data8 = volume;
+    const uint16_t* data16 = (const uint16_t*) volume;
+    parallelFor(values_z, last_z + 1, [&](int begin, int end)
+    {
+        size_t src = begin * slice_len;
+        size_t dst = (begin - values_z) * slice_len;
+        size_t len = (end - begin) * slice_len;
+        if(datasize_bytes == 1)
+            std::copy(data8 + src, data8 + src + len, values.begin() + dst);
+        else
+            std::copy(data16 + src, data16 + src + len, values.begin() + dst);
+    });
+}
+
+//Neighbouring rows are clamped at the border, like GL_CLAMP_TO_EDGE does for the central differences in the shader.
+const float* GradientVolume::getRow(int y, int z)
+{
+    y = std::min(std::max(y, 0), dim.y - 1);
+    z = std::min(std::max(z, 0), dim.z - 1);
+    return &values[((size_t)(z - values_z) * dim.y + y) * dim.x];
+}
+
+/* The kernel is applied separably on whole rows: first along z for the three rows y-1, y, y+1, then along y, then the
+ * x neighbours are read from arrays padded by one clamped element on either side. Every loop is a plain pass over
+ * contiguous floats without branches, which the compiler vectorizes.
+ */
+void GradientVolume::computeRow(int y, int z, float* scratch, uint8_t* out)
+{
+    const int n = dim.x;
+    const float s = side_weight, c = center_weight;
+    float* smooth_z[3] = {scratch, scratch + n, scratch + 2 * n};
+    float* diff_z[3] = {scratch + 3 * n, scratch + 4 * n, scratch + 5 * n};
+    float* a = scratch + 6 * n + 1;          // Smoothed along y and z, differenced along x
+    float* b = a + n + 2;                    // Smoothed along z, differenced along y
+    float* d = b + n + 2;                    // Differenced along z, smoothed along y
+    float* gx = d + n + 1;
+    float* gy = gx + n;
+    float* gz = gy + n;
+
+    for(int dy = 0; dy < 3; dy++)
+    {
+        const float* back = getRow(y + dy - 1, z - 1);
+        const float* mid = getRow(y + dy - 1, z);
+        const float* front = getRow(y + dy - 1, z + 1);
+        float* sz = smooth_z[dy];
+        float* dz = diff_z[dy];
+        for(int x = 0; x < n; x++)
+        {
+            sz[x] = s * back[x] + c * mid[x] + s * front[x];
+            dz[x] = front[x] - back[x];
+        }
+    }
+
+    for(int x = 0; x < n; x++)
+    {
+        a[x] = s * smooth_z[0][x] + c * smooth_z[1][x] + s * smooth_z[2][x];
+        b[x] = smooth_z[2][x] - smooth_z[0][x];
+        d[x] = s * diff_z[0][x] + c * diff_z[1][x] + s * diff_z[2][x];
+    }
+    a[-1] = a[0]; a[n] = a[n - 1];
+    b[-1] = b[0]; b[n] = b[n - 1];
+    d[-1] = d[0]; d[n] = d[n - 1];
+
+    for(int x = 0; x < n; x++)
+    {
+        gx[x] = norm * (a[x + 1] - a[x - 1]);
+        gy[x] = norm * (s * b[x - 1] + c * b[x] + s * b[x + 1]);
+        gz[x] = norm * (s * d[x - 1] + c * d[x] + s * d[x + 1]);
+    }
+
+    for(int x = 0; x < n; x++)
+        encode(gx[x], gy[x], gz[x], inv_range, out + x * 3);
+}
+
+//Octahedral encoding, the direction is projected onto the octahedron |x|+|y|+|z| = 1 and the lower half folded out.
+void GradientVolume::encode(float gx, float gy, float gz, float inv_range, uint8_t* out)
+{
+    float l1 = std::abs(gx) + std::abs(gy) + std::abs(gz);
+    float ox = 0.0f, oy = 0.0f;
+    if(l1 > 0.0f)
+    {
+        ox = gx / l1;
+        oy = gy / l1;
+        if(gz < 0.0f)
+        {
+            float fx = (1.0f - std::abs(oy)) * ((ox >= 0.0f) ? 1.0f : -1.0f);
+            float fy = (1.0f - std::abs(ox)) * ((oy >= 0.0f) ? 1.0f : -1.0f);
+            ox = fx;
+            oy = fy;
+        }
+    }
+    float magnitude = std::sqrt(std::min(std::sqrt(gx * gx + gy * gy + gz * gz) * inv_range, 1.0f));
+    out[0] = (uint8_t) std::round((ox * 0.5f + 0.5f) * 255.0f);
+    out[1] = (uint8_t) std::round((oy * 0.5f + 0.5f) * 255.0f);
+    out[2] = (uint8_t) std::round(magnitude * 255.0f);
+}
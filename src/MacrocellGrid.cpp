@@ -0,0 +1,80 @@
+#include "MacrocellGrid.h"
+#include "BSplineCoefficients.h"
+#include "ParallelFor.h"
+
+#include <algorithm>
+#include <cmath>
+
+const int MacrocellGrid::cell_size;
+
+MacrocellGrid::MacrocellGrid() : grid_dim(0, 0, 0)
+{
+    //ctor
+}
+
+MacrocellGrid::~MacrocellGrid()
+{
+    //dtor
+}
+
+void MacrocellGrid::build(const std::vector<uint8_t>& volume_data, int datasize_bytes, glm::ivec3 volume_dim)
+{
+    /* Cells overlap their neighbours by one voxel so that interpolated samples
+     * on a cell boundary are still inside the range of the cell.
+     */
+    const uint8_t* data8 = volume_data.data();
+    const uint16_t* data16 = (const uint16_t*) volume_data.data();
+    computeRanges(volume_dim, 1, [&](size_t idx)
+    {
+        return (float) ((datasize_bytes == 1) ? data8[idx] : data16[idx]);
+    });
+}
+
+/* A cubic B-spline sample is a weighted average with non-negative weights of the 4^3 coefficients around it, so it lies
+ * between their min and max but can overshoot the voxel values. Those coefficients reach two voxels past the cell.
+ */
+void MacrocellGrid::build(const BSplineCoefficients& bspline, float value_range)
+{
+    const float* coeffs = bspline.coeffs.data();
+    computeRanges(bspline.dim, 2, [&](size_t idx)
+    {
+        return coeffs[idx] * value_range;
+    });
+}
+
+//Stores the range of every cell and the overlap voxels around it, clamped to the raw values the texture can hold.
+template<typename ValueFunc>
+void MacrocellGrid::computeRanges(glm::ivec3 volume_dim, int overlap, ValueFunc value)
+{
+    grid_dim = (volume_dim + glm::ivec3(cell_size - 1)) / cell_size;
+    cells.assign((size_t)grid_dim.x * grid_dim.y * grid_dim.z * 2, 0);
+    size_t slice_len = (size_t)volume_dim.x * volume_dim.y;
+
+    parallelFor(0, grid_dim.z, [&](int cz_begin, int cz_end)
+    {
+        for(int cz = cz_begin; cz < cz_end; cz++)
+        for(int cy = 0; cy < grid_dim.y; cy++)
+        for(int cx = 0; cx < grid_dim.x; cx++)
+        {
+            glm::ivec3 v_min = glm::max(glm::ivec3(cx, cy, cz) * cell_size - overlap, glm::ivec3(0));
+            glm::ivec3 v_max = glm::min(glm::ivec3(cx + 1, cy + 1, cz + 1) * cell_size + overlap, volume_dim);
+
+            float min_v = 65535.0f, max_v = 0.0f;
+            for(int z = v_min.z; z < v_max.z; z++)
+            for(int y = v_min.y; y < v_max.y; y++)
+            {
+                size_t row = z * slice_len + (size_t)y * volume_dim.x;
+                for(int x = v_min.x; x < v_max.x; x++)
+                {
+                    float val = value(row + x);
+                    min_v = std::min(min_v, val);
+                    max_v = std::max(max_v, val);
+                }
+            }
+
+            size_t idx = (((size_t)cz * grid_dim.y + cy) * grid_dim.x + cx) * 2;
+            cells[idx] = (uint16_t) std::max(std::floor(min_v), 0.0f);
+            cells[idx + 1] = (uint16_t) std::min(std::ceil(max_v), 65535.0f);
+        }
+    });
+}
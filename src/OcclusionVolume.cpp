@@ -0,0 +1,257 @@
+#include "OcclusionVolume.h"
+#include "MacrocellGrid.h"
+#include "ParallelFor.h"
+
+#include <algorithm>
+#include <cmath>
+
+const int OcclusionVolume::downsample;
+
+namespace
+{
+    const int num_axis_steps = 4;   // Steps along the 6 axis directions, one macrocell at most.
+    const int num_diag_steps = 3;   // Steps along the 8 diagonals, each moves one voxel on every axis.
+    const glm::ivec3 directions[14] = {glm::ivec3(1, 0, 0), glm::ivec3(-1, 0, 0), glm::ivec3(0, 1, 0), glm::ivec3(0, -1, 0),
+                                       glm::ivec3(0, 0, 1), glm::ivec3(0, 0, -1), glm::ivec3(1, 1, 1), glm::ivec3(1, 1, -1),
+                                       glm::ivec3(1, -1, 1), glm::ivec3(1, -1, -1), glm::ivec3(-1, 1, 1), glm::ivec3(-1, 1, -1),
+                                       glm::ivec3(-1, -1, 1), glm::ivec3(-1, -1, -1)};
+}
+
+OcclusionVolume::OcclusionVolume() : dim(0, 0, 0), cancel_job(false), is_done(false)
+{
+    datasize_bytes = 1;
+    cell_size = MacrocellGrid::cell_size / downsample;
+}
+
+OcclusionVolume::~OcclusionVolume()
+{
+    cancel();
+}
+
+/* Keeps a reference to the volume for the background jobs. Everything starts out fully visible and every cell pending,
+ * the first update() computes the whole volume.
+ */
+void OcclusionVolume::setup(std::shared_ptr<const std::vector<uint8_t>> volume_data, int datasize_bytes, glm::ivec3 volume_dim, const MacrocellGrid& macrocells)
+{
+    cancel();
+    this->volume_data = volume_data;
+    this->datasize_bytes = datasize_bytes;
+    this->volume_dim = volume_dim;
+    dim = (volume_dim + downsample - 1) / downsample;
+    grid_dim = macrocells.grid_dim;
+    cell_ranges = macrocells.cells;
+
+    size_t len = (size_t)dim.x * dim.y * dim.z;
+    visibility.assign(len, 255);
+    transmittance.assign(len, 255);
+    pending_cells.assign((size_t)grid_dim.x * grid_dim.y * grid_dim.z, 1);
+    opacity.clear();
+}
+
+/* Marks the cells containing a raw value whose opacity changed and restarts the job with them. A running or unpolled
+ * job is cancelled, its cells go back to pending so they are part of the new one.
+ */
+void OcclusionVolume::update(const std::vector<float>& opacity)
+{
+    if(!volume_data)
+        return;
+
+    //Prefix sum over the changed values, so the test for a cell's range is two lookups.
+    std::vector<int> changed(opacity.size() + 1, 0);
+    bool is_changed = (this->opacity.size() != opacity.size());
+    for(size_t i = 0; i < opacity.size(); i++)
+    {
+        bool is_diff = is_changed || std::abs(this->opacity[i] - opacity[i]) > 0.5f / 255.0f;
+        changed[i + 1] = changed[i] + (is_diff ? 1 : 0);
+    }
+    if(changed.back() == 0)
+        return;
+
+    cancel();
+    this->opacity = opacity;
+    int max_value = (int) opacity.size() - 1;
+    for(size_t i = 0; i < pending_cells.size(); i++)
+    {
+        int lo = std::min((int) cell_ranges[i * 2], max_value);
+        int hi = std::min((int) cell_ranges[i * 2 + 1], max_value);
+        if(changed[hi + 1] - changed[lo] > 0)
+            pending_cells[i] = 1;
+    }
+
+    if(std::find(pending_cells.begin(), pending_cells.end(), 1) == pending_cells.end())
+        return;
+
+    job_cells.swap(pending_cells);
+    pending_cells.assign(job_cells.size(), 0);
+    is_done = false;
+    worker = std::thread(&OcclusionVolume::compute, this);
+}
+
+//Returns the occlusion voxels [region_min, region_max) that changed since the last poll, once a job is done.
+bool OcclusionVolume::poll(glm::ivec3& region_min, glm::ivec3& region_max)
+{
+    if(!is_done)
+        return false;
+
+    worker.join();
+    is_done = false;
+    region_min = job_min;
+    region_max = job_max;
+    return region_min.x < region_max.x;
+}
+
+void OcclusionVolume::cancel()
+{
+    if(!worker.joinable())
+        return;
+
+    cancel_job = true;
+    worker.join();
+    cancel_job = false;
+    is_done = false;
+    for(size_t i = 0; i < job_cells.size(); i++)
+        pending_cells[i] |= job_cells[i];
+}
+
+bool OcclusionVolume::isBusy()
+{
+    return worker.joinable();
+}
+
+glm::ivec3 OcclusionVolume::getCellMin(int cx, int cy, int cz)
+{
+    return glm::ivec3(cx, cy, cz) * cell_size;
+}
+
+glm::ivec3 OcclusionVolume::getCellMax(int cx, int cy, int cz)
+{
+    return glm::min(glm::ivec3(cx + 1, cy + 1, cz + 1) * cell_size, dim);
+}
+
+size_t OcclusionVolume::getCellIndex(int cx, int cy, int cz)
+{
+    return ((size_t)cz * grid_dim.y + cy) * grid_dim.x + cx;
+}
+
+/* Two passes over the cells, first the transmittance of the changed cells, then the visibility of every cell that has
+ * one of them within the kernel. The kernel reaches at most one macrocell, so that is the changed cells and their
+ * 26 neighbours. Checks for cancellation after every row of cells.
+ */
+void OcclusionVolume::compute()
+{
+    std::vector<uint8_t> visible_cells(job_cells.size(), 0);
+    glm::ivec3 cell_min(grid_dim), cell_max(-1);
+    for(int cz = 0; cz < grid_dim.z; cz++)
+    for(int cy = 0; cy < grid_dim.y; cy++)
+    for(int cx = 0; cx < grid_dim.x; cx++)
+    {
+        if(!job_cells[getCellIndex(cx, cy, cz)])
+            continue;
+        glm::ivec3 lo = glm::max(glm::ivec3(cx, cy, cz) - 1, glm::ivec3(0));
+        glm::ivec3 hi = glm::min(glm::ivec3(cx, cy, cz) + 1, grid_dim - 1);
+        for(int z = lo.z; z <= hi.z; z++)
+        for(int y = lo.y; y <= hi.y; y++)
+        for(int x = lo.x; x <= hi.x; x++)
+            visible_cells[getCellIndex(x, y, z)] = 1;
+        cell_min = glm::min(cell_min, lo);
+        cell_max = glm::max(cell_max, hi);
+    }
+
+    parallelFor(0, grid_dim.z * grid_dim.y, [&](int row_begin, int row_end)
+    {
+        for(int row = row_begin; row < row_end && !cancel_job; row++)
+        for(int cx = 0; cx < grid_dim.x; cx++)
+        {
+            if(job_cells[getCellIndex(cx, row % grid_dim.y, row / grid_dim.y)])
+                computeTransmittance(cx, row % grid_dim.y, row / grid_dim.y);
+        }
+    });
+
+    parallelFor(0, grid_dim.z * grid_dim.y, [&](int row_begin, int row_end)
+    {
+        for(int row = row_begin; row < row_end && !cancel_job; row++)
+        for(int cx = 0; cx < grid_dim.x; cx++)
+        {
+            if(visible_cells[getCellIndex(cx, row % grid_dim.y, row / grid_dim.y)])
+                computeVisibility(cx, row % grid_dim.y, row / grid_dim.y);
+        }
+    });
+    if(cancel_job)
+        return;
+
+    job_min = getCellMin(cell_min.x, cell_min.y, cell_min.z);
+    job_max = (cell_max.x < 0) ? job_min : getCellMax(cell_max.x, cell_max.y, cell_max.z);
+    is_done = true;
+    if(on_done)
+        on_done();
+}
+
+//Average opacity of the downsample^3 voxels, as the transmittance of a path of the same length through them.
+void OcclusionVolume::computeTransmittance(int cx, int cy, int cz)
+{
+    const uint8_t* data8 = volume_data->data();
+    const uint16_t* data16 = (const uint16_t*) volume_data->data();
+    size_t slice_len = (size_t)volume_dim.x * volume_dim.y;
+    glm::ivec3 v_min = getCellMin(cx, cy, cz), v_max = getCellMax(cx, cy, cz);
+
+    for(int z = v_min.z; z < v_max.z; z++)
+    for(int y = v_min.y; y < v_max.y; y++)
+    for(int x = v_min.x; x < v_max.x; x++)
+    {
+        glm::ivec3 src_min = glm::ivec3(x, y, z) * downsample;
+        glm::ivec3 src_max = glm::min(src_min + downsample, volume_dim);
+        float sum = 0.0f;
+        int count = 0;
+        for(int sz = src_min.z; sz < src_max.z; sz++)
+        for(int sy = src_min.y; sy < src_max.y; sy++)
+        {
+            size_t row = sz * slice_len + (size_t)sy * volume_dim.x;
+            for(int sx = src_min.x; sx < src_max.x; sx++)
+            {
+                int val = (datasize_bytes == 1) ? data8[row + sx] : data16[row + sx];
+                sum += opacity[std::min(val, (int) opacity.size() - 1)];
+                count++;
+            }
+        }
+        float t = std::pow(1.0f - sum / count, (float) downsample);
+        transmittance[((size_t)z * dim.y + y) * dim.x + x] = (uint8_t) std::round(t * 255.0f);
+    }
+}
+
+/* Transmittance along every direction is the product over its steps, diagonal steps are sqrt(3) times as long. Steps
+ * leaving the volume see empty space. The visibility is the average over the directions.
+ */
+void OcclusionVolume::computeVisibility(int cx, int cy, int cz)
+{
+    float axis_lut[256], diag_lut[256];
+    for(int i = 0; i < 256; i++)
+    {
+        axis_lut[i] = i / 255.0f;
+        diag_lut[i] = std::pow(i / 255.0f, std::sqrt(3.0f));
+    }
+
+    glm::ivec3 v_min = getCellMin(cx, cy, cz), v_max = getCellMax(cx, cy, cz);
+    for(int z = v_min.z; z < v_max.z; z++)
+    for(int y = v_min.y; y < v_max.y; y++)
+    for(int x = v_min.x; x < v_max.x; x++)
+    {
+        float sum = 0.0f;
+        for(int d = 0; d < 14; d++)
+        {
+            bool is_diag = (d >= 6);
+            const float* lut = (is_diag) ? diag_lut : axis_lut;
+            int steps = (is_diag) ? num_diag_steps : num_axis_steps;
+            float t = 1.0f;
+            glm::ivec3 p(x, y, z);
+            for(int i = 0; i < steps; i++)
+            {
+                p += directions[d];
+                if(p.x < 0 || p.y < 0 || p.z < 0 || p.x >= dim.x || p.y >= dim.y || p.z >= dim.z)
+                    break;
+                t *= lut[transmittance[((size_t)p.z * dim.y + p.y) * dim.x + p.x]];
+            }
+            sum += t;
+        }
+        visibility[((size_t)z * dim.y + y) * dim.x + x] = (uint8_t) std::round(sum / 14.0f * 255.0f);
+    }
+}
@@ -0,0 +1,54 @@
+#include "OpacityRangeTable.h"
+
+#include <algorithm>
+#include <cmath>
+
+const int OpacityRangeTable::size;
+
+OpacityRangeTable::OpacityRangeTable()
+{
+    //ctor
+}
+
+OpacityRangeTable::~OpacityRangeTable()
+{
+    //dtor
+}
+
+void OpacityRangeTable::build(const std::vector<glm::vec4>& tf_table)
+{
+    /* Bin k stands for the windowed value k / (size - 1). The opacity between bins k and k + 1 is bounded by the entries
+     * from the one at or below bin k to the one at or above bin k + 1.
+     */
+    int lut_last = (int) tf_table.size() - 1;
+    float entries_per_bin = lut_last / float(size - 1);
+    std::vector<glm::vec2> bins(size);
+    for(int k = 0; k < size; k++)
+    {
+        int lo = std::min((int) std::floor(k * entries_per_bin), lut_last);
+        int hi = std::min((int) std::ceil((k + 1) * entries_per_bin), lut_last);
+        glm::vec2 range(tf_table[lo].w, tf_table[lo].w);
+        for(int j = lo + 1; j <= hi; j++)
+        {
+            range.x = std::max(range.x, tf_table[j].w);
+            range.y = std::min(range.y, tf_table[j].w);
+        }
+        bins[k] = range;
+    }
+
+    //A range of a single bin only sees the entries around that value, wider ranges combine the bins in between.
+    table.resize(size * size);
+    for(int a = 0; a < size; a++)
+    {
+        int lo = (int) std::floor(a * entries_per_bin), hi = std::min((int) std::ceil(a * entries_per_bin), lut_last);
+        glm::vec2 range(std::max(tf_table[lo].w, tf_table[hi].w), std::min(tf_table[lo].w, tf_table[hi].w));
+        table[a * size + a] = range;
+        for(int b = a + 1; b < size; b++)
+        {
+            range.x = std::max(range.x, bins[b - 1].x);
+            range.y = std::min(range.y, bins[b - 1].y);
+            table[b * size + a] = range;
+            table[a * size + b] = range;
+        }
+    }
+}
@@ -0,0 +1,96 @@
+#include "PreIntegrationTable.h"
+#include "ParallelFor.h"
+
+#include <algorithm>
+#include <cmath>
+#include "glm/glm.hpp"
+
+PreIntegrationTable::PreIntegrationTable()
+{
+    size = 0;
+    dirty_min = dirty_max = -1;
+}
+
+PreIntegrationTable::~PreIntegrationTable()
+{
+    //dtor
+}
+
+bool PreIntegrationTable::update(const std::vector<glm::vec4>& tf_table)
+{
+    //Find the range of transfer function entries that actually changed.
+    dirty_min = dirty_max = -1;
+    if(tf_table.size() != size)
+    {
+        size = tf_table.size();
+        table.assign(size * size, glm::vec4(0.0f));
+        dirty_min = 0;
+        dirty_max = size - 1;
+    }
+    else
+    {
+        for(int i = 0; i < size; i++)
+        {
+            if(tf_table[i] != transfer_func[i])
+            {
+                if(dirty_min == -1)
+                    dirty_min = i;
+                dirty_max = i;
+            }
+        }
+        if(dirty_min == -1)
+            return false;
+    }
+    transfer_func = tf_table;
+
+    /* Extinction per reference step is derived from the opacity of a single sample, tau = -ln(1 - alpha). Both integrals
+     * use the trapezoidal rule over the table entries, the color integral is weighted by extinction.
+     */
+    extinction_integral.assign(size, 0.0f);
+    color_integral.assign(size, glm::vec3(0.0f));
+    float prev_tau = -std::log(1.0f - std::min(transfer_func[0].w, 0.9999f));
+    glm::vec3 prev_col = glm::vec3(transfer_func[0]) * prev_tau;
+    for(int i = 1; i < size; i++)
+    {
+        float tau = -std::log(1.0f - std::min(transfer_func[i].w, 0.9999f));
+        glm::vec3 col = glm::vec3(transfer_func[i]) * tau;
+        extinction_integral[i] = extinction_integral[i-1] + 0.5f * (tau + prev_tau);
+        color_integral[i] = color_integral[i-1] + 0.5f * (col + prev_col);
+        prev_tau = tau;
+        prev_col = col;
+    }
+
+    //A segment (front, back) depends on the integrals over [min, max], so only segments overlapping the dirty range change.
+    parallelFor(0, size, [&](int y_begin, int y_end)
+    {
+        for(int back = y_begin; back < y_end; back++)
+        {
+            for(int front = 0; front < size; front++)
+            {
+                int lo = std::min(front, back), hi = std::max(front, back);
+                if(lo > dirty_max || hi < dirty_min)
+                    continue;
+
+                float tau;
+                glm::vec3 col;
+                if(lo == hi)
+                {
+                    tau = -std::log(1.0f - std::min(transfer_func[lo].w, 0.9999f));
+                    col = glm::vec3(transfer_func[lo]);
+                }
+                else
+                {
+                    tau = (extinction_integral[hi] - extinction_integral[lo]) / (hi - lo);
+                    if(tau > 0.0f)
+                        col = (color_integral[hi] - color_integral[lo]) / (extinction_integral[hi] - extinction_integral[lo]);
+                    else
+                        col = 0.5f * glm::vec3(transfer_func[lo] + transfer_func[hi]);
+                }
+
+                float alpha = 1.0f - std::exp(-tau);
+                table[back * size + front] = glm::vec4(col * alpha, alpha);
+            }
+        }
+    });
+    return true;
+}
@@ -0,0 +1,90 @@
+#include <cstring>
+
+#include "RenderStateBuffer.h"
+
+const int RenderStateBuffer::num_slots;
+
+RenderStateBuffer::RenderStateBuffer()
+{
+    ubo_ID = 0;
+    slot_stride = 0;
+    for(int i = 0; i < num_slots; i++)
+        is_slot_valid[i] = false;
+}
+
+RenderStateBuffer::~RenderStateBuffer()
+{
+    if(ubo_ID)
+        glDeleteBuffers(1, &ubo_ID);
+}
+
+void RenderStateBuffer::setup()
+{
+    //Slots are bound with glBindBufferRange, so they start at multiples of the offset alignment.
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    slot_stride = ((sizeof(RenderState) + alignment - 1) / alignment) * alignment;
+
+    glGenBuffers(1, &ubo_ID);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo_ID);
+    glBufferData(GL_UNIFORM_BUFFER, slot_stride * num_slots, NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void RenderStateBuffer::upload(int slot, const RenderState& state)
+{
+    const int row_size = 16;
+    const int num_rows = sizeof(RenderState) / row_size;
+    const char* src = (const char*) &state;
+    char* prev = (char*) &slot_states[slot];
+
+    int first_row = 0, last_row = num_rows - 1;
+    if(is_slot_valid[slot])
+    {
+        while(first_row < num_rows && memcmp(src + first_row * row_size, prev + first_row * row_size, row_size) == 0)
+            first_row++;
+        if(first_row == num_rows)
+            return;
+        while(memcmp(src + last_row * row_size, prev + last_row * row_size, row_size) == 0)
+            last_row--;
+    }
+
+    /* RenderThread::acquireSlot() waited for the slot's fence, so the GPU doesn't read it while it is written and the
+     * mapping doesn't need to synchronize. Rows in between that didn't change are skipped, only the runs of changed
+     * rows are flushed.
+     */
+    GLintptr map_offset = first_row * row_size;
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo_ID);
+    char* dst = (char*) glMapBufferRange(GL_UNIFORM_BUFFER, getOffset(slot) + map_offset, (last_row - first_row + 1) * row_size,
+                                         GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_FLUSH_EXPLICIT_BIT);
+    if(dst)
+    {
+        int run_start = -1;
+        for(int row = first_row; row <= last_row + 1; row++)
+        {
+            bool is_changed = row <= last_row && (!is_slot_valid[slot] || memcmp(src + row * row_size, prev + row * row_size, row_size) != 0);
+            if(is_changed && run_start < 0)
+                run_start = row;
+            else if(!is_changed && run_start >= 0)
+            {
+                memcpy(dst + run_start * row_size - map_offset, src + run_start * row_size, (row - run_start) * row_size);
+                glFlushMappedBufferRange(GL_UNIFORM_BUFFER, run_start * row_size - map_offset, (row - run_start) * row_size);
+                run_start = -1;
+            }
+        }
+        //Contents are undefined if unmapping fails, the slot is written completely next time.
+        slot_states[slot] = state;
+        is_slot_valid[slot] = (glUnmapBuffer(GL_UNIFORM_BUFFER) == GL_TRUE);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+GLuint RenderStateBuffer::getBufferID()
+{
+    return ubo_ID;
+}
+
+GLintptr RenderStateBuffer::getOffset(int slot)
+{
+    return slot * slot_stride;
+}
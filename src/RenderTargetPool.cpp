@@ -0,0 +1,64 @@
+#include "RenderTargetPool.h"
+
+RenderTargetPool::RenderTargetPool()
+{
+    //ctor
+}
+
+RenderTargetPool::~RenderTargetPool()
+{
+    clear();
+}
+
+GLuint RenderTargetPool::acquire(glm::ivec2 size, GLenum internal_format)
+{
+    for(int i = 0; i < targets.size(); i++)
+    {
+        if(!targets[i].is_used && targets[i].size == size && targets[i].internal_format == internal_format)
+        {
+            targets[i].is_used = true;
+            return targets[i].tex_ID;
+        }
+    }
+
+    Target target = {0, size, internal_format, true};
+    glGenTextures(1, &target.tex_ID);
+    glBindTexture(GL_TEXTURE_2D, target.tex_ID);
+    glTexStorage2D(GL_TEXTURE_2D, 1, internal_format, size.x, size.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    targets.push_back(target);
+    return target.tex_ID;
+}
+
+void RenderTargetPool::release(GLuint tex_ID)
+{
+    for(int i = 0; i < targets.size(); i++)
+    {
+        if(targets[i].tex_ID == tex_ID)
+            targets[i].is_used = false;
+    }
+}
+
+//Deletes the unused targets of any other size, after a resize they are unlikely to be requested again.
+void RenderTargetPool::trim(glm::ivec2 size)
+{
+    for(int i = targets.size() - 1; i >= 0; i--)
+    {
+        if(!targets[i].is_used && targets[i].size != size)
+        {
+            glDeleteTextures(1, &targets[i].tex_ID);
+            targets.erase(targets.begin() + i);
+        }
+    }
+}
+
+void RenderTargetPool::clear()
+{
+    for(int i = 0; i < targets.size(); i++)
+        glDeleteTextures(1, &targets[i].tex_ID);
+    targets.clear();
+}
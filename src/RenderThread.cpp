@@ -0,0 +1,430 @@
+#include <algorithm>
+
+#include "RenderThread.h"
+#include "GpuTimer.h"
+#include "glm/glm.hpp"
+
+namespace
+{
+    const int tile_size = 128;  // Tile edge in pixels, rounded down to whole workgroups.
+}
+
+RenderThread::RenderThread() : samples_per_ray(0.0f), cancelled_frames(0), context(NULL), mailbox(-1), active_slot(-1),
+                               is_stopping(false), is_kernel_reset(false), front_info(256 << 1), kernel_ms(0.0f), light_ms(0.0f)
+{
+    light_version = -1;
+    blit_fences[0] = blit_fences[1] = nullptr;
+    for(int i = 0; i < RenderStateBuffer::num_slots; i++)
+        slot_fences[i] = nullptr;
+    blit_target = 0;
+    history_world_mat = glm::mat4(1.0f);
+    last_slot = -1;
+    tile_ms = 1.0f;
+    frame_ms = 0.0f;
+    frame_scale = 1.0f;
+    is_frame_timed = false;
+    //ctor
+}
+
+RenderThread::~RenderThread()
+{
+    stop();
+    for(int i = 0; i < RenderStateBuffer::num_slots; i++)
+        glDeleteSync(slot_fences[i].exchange(nullptr));
+}
+
+void RenderThread::start(GLFWwindow* context, const Resources& res)
+{
+    stop();
+    this->context = context;
+    this->res = res;
+    is_stopping = false;
+    thread = std::thread(&RenderThread::run, this);
+}
+
+void RenderThread::stop()
+{
+    if(!thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        is_stopping = true;
+    }
+    wake_cv.notify_one();
+    thread.join();
+
+    int slot = mailbox.exchange(-1);
+    if(slot >= 0)
+        glDeleteSync(requests[slot].state_fence);
+    std::lock_guard<std::mutex> lock(blit_mutex);
+    for(int i = 0; i < 2; i++)
+    {
+        glDeleteSync(blit_fences[i]);
+        blit_fences[i] = nullptr;
+    }
+}
+
+/* The thread only ever moves the queued slot to active_slot, and the UI thread knows which slot it queued last. A slot
+ * that is neither of them can't be picked up while it is written. Reading active_slot early is fine, it can only change
+ * to the excluded last_slot or to -1. The GPU may still read a slot whose frame was left early, e.g. when the thread is
+ * stopped mid-frame, so its fence is waited on before the slot is handed out. Fences are kept across restarts.
+ */
+int RenderThread::acquireSlot()
+{
+    int active = active_slot;
+    for(int i = 0; i < RenderStateBuffer::num_slots; i++)
+    {
+        if(i != active && i != last_slot)
+        {
+            GLsync fence = slot_fences[i].exchange(nullptr);
+            if(fence)
+            {
+                GLenum status = GL_TIMEOUT_EXPIRED;
+                while(status == GL_TIMEOUT_EXPIRED)
+                    status = glClientWaitSync(fence, 0, 100000000);
+                glDeleteSync(fence);
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+RenderThread::Request& RenderThread::getRequest(int slot)
+{
+    return requests[slot];
+}
+
+void RenderThread::submit(int slot)
+{
+    last_slot = slot;
+    int stale = mailbox.exchange(slot);
+    if(stale >= 0)
+    {
+        glDeleteSync(requests[stale].state_fence);
+        cancelled_frames++;
+    }
+
+    //The lock only orders the wake up against the thread going to sleep, the mailbox itself is lock free.
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+    }
+    wake_cv.notify_one();
+}
+
+//Blocks until the submitted frames are done, needed before deleting objects a pending request refers to.
+void RenderThread::waitIdle()
+{
+    std::unique_lock<std::mutex> lock(wake_mutex);
+    idle_cv.wait(lock, [this]{ return !thread.joinable() || (active_slot < 0 && mailbox < 0); });
+}
+
+/* Returns the target to blit and the scale it was rendered at. Picking the target and storing the fence of its blit in
+ * endBlit() is one step for the render thread, it can't start clearing the target the UI is about to read.
+ */
+int RenderThread::beginBlit(float& render_scale)
+{
+    blit_mutex.lock();
+    int info = front_info;
+    blit_target = info & 1;
+    render_scale = (info >> 1) / 256.0f;
+    return blit_target;
+}
+
+void RenderThread::endBlit(GLsync fence)
+{
+    glDeleteSync(blit_fences[blit_target]);
+    blit_fences[blit_target] = fence;
+    blit_mutex.unlock();
+}
+
+bool RenderThread::isBusy()
+{
+    return active_slot >= 0 || mailbox >= 0;
+}
+
+int RenderThread::getFrontTarget()
+{
+    return front_info & 1;
+}
+
+float RenderThread::getFrontScale()
+{
+    return (front_info >> 1) / 256.0f;
+}
+
+/* GPU time of the raymarch dispatches of the last frame, summed over its slices and extrapolated to all tiles if the
+ * frame was abandoned. Returns false if no frame finished or was abandoned since the last call.
+ */
+bool RenderThread::getFrameTime(float& gpu_ms, float& render_scale)
+{
+    std::lock_guard<std::mutex> lock(timing_mutex);
+    if(!is_frame_timed)
+        return false;
+    gpu_ms = frame_ms;
+    render_scale = frame_scale;
+    is_frame_timed = false;
+    return true;
+}
+
+float RenderThread::getKernelTime()
+{
+    return kernel_ms;
+}
+
+float RenderThread::getLightTime()
+{
+    return light_ms;
+}
+
+void RenderThread::resetKernelTime()
+{
+    is_kernel_reset = true;
+}
+
+void RenderThread::run()
+{
+    glfwMakeContextCurrent(context);
+    GLuint clear_fbo;
+    glGenFramebuffers(1, &clear_fbo);
+    {
+        //Query objects aren't shared between contexts so the thread has its own timer.
+        GpuTimer gpu_timer;
+        while(true)
+        {
+            int slot = -1;
+            {
+                std::unique_lock<std::mutex> lock(wake_mutex);
+                wake_cv.wait(lock, [this]{ return is_stopping || mailbox >= 0; });
+                if(is_stopping)
+                    break;
+                slot = mailbox.exchange(-1);
+                active_slot = slot;
+            }
+
+            renderFrame(slot, clear_fbo, gpu_timer);
+
+            gpu_timer.nextFrame();
+            if(is_kernel_reset.exchange(false))
+                gpu_timer.resetAverages();
+            kernel_ms = gpu_timer.getAverage("raymarch");
+            light_ms = gpu_timer.getAverage("light");
+            {
+                std::lock_guard<std::mutex> lock(wake_mutex);
+                active_slot = -1;
+            }
+            idle_cv.notify_all();
+            //The UI loop may be asleep waiting for events, the finished frame has to be shown.
+            glfwPostEmptyEvent();
+        }
+    }
+    glDeleteFramebuffers(1, &clear_fbo);
+    glfwMakeContextCurrent(NULL);
+}
+
+void RenderThread::renderFrame(int slot, GLuint clear_fbo, GpuTimer& gpu_timer)
+{
+    const Request& req = requests[slot];
+    glWaitSync(req.state_fence, 0, GL_TIMEOUT_IGNORED);
+    glDeleteSync(req.state_fence);
+    int front = getFrontTarget(), back = 1 - front;
+
+    /* The back target was the front one before the last swap, the UI may still be blitting from it. Once the fence is
+     * taken the UI only picks the front target, this thread is the only one changing it.
+     */
+    GLsync fence;
+    {
+        std::lock_guard<std::mutex> lock(blit_mutex);
+        fence = blit_fences[back];
+        blit_fences[back] = nullptr;
+    }
+    if(fence)
+    {
+        glWaitSync(fence, 0, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fence);
+    }
+
+    //Bindings are per context, so everything the shader uses is bound again here.
+    glUseProgram(req.program_ID);
+    glUniform1i(15, (history_world_mat != req.world_mat) ? 1 : 0);
+    glUniformMatrix4fv(16, 1, GL_FALSE, &history_world_mat[0][0]);
+    glBindImageTexture(0, res.targets[back], 0, GL_FALSE, 0, GL_WRITE_ONLY, res.target_format);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, res.vol_tex);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_3D, res.macrocell_tex);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, res.preint_tex);
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_1D, res.tf_tex);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D, res.history_tex);
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_3D, res.gradient_tex);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, res.stats_ssbo);
+    glBindBufferRange(GL_UNIFORM_BUFFER, 1, res.state_ubo, slot * res.state_stride, sizeof(RenderState));
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_3D, res.light_tex);
+    glActiveTexture(GL_TEXTURE8);
+    glBindTexture(GL_TEXTURE_3D, res.occlusion_tex);
+    glActiveTexture(GL_TEXTURE9);
+    glBindTexture(GL_TEXTURE_2D, res.opacity_range_tex);
+    if(req.light_program_ID && req.light_version != light_version)
+    {
+        updateLightVolume(req, gpu_timer);
+        fenceSlot(slot);
+    }
+
+    /* Pixels outside the dispatched rectangle are only cleared. Inside it the previous frame is kept until the tiles
+     * covering it are done, so a progressively shown frame doesn't flash black.
+     */
+    const GLfloat clear_color[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, clear_fbo);
+    glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, res.targets[back], 0);
+    glClearBufferfv(GL_COLOR, 0, clear_color);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+
+    glm::ivec2 rect_size = glm::min(req.workgroups * req.local_size, req.target_size - req.tile_offset);
+    if(getFrontScale() == req.render_scale && rect_size.x > 0 && rect_size.y > 0)
+        glCopyImageSubData(res.targets[front], GL_TEXTURE_2D, 0, req.tile_offset.x, req.tile_offset.y, 0,
+                           res.targets[back], GL_TEXTURE_2D, 0, req.tile_offset.x, req.tile_offset.y, 0, rect_size.x, rect_size.y, 1);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, res.stats_ssbo);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    //Tiles in workgroups, ordered by the distance of their center to the center of the dispatched rectangle.
+    glm::ivec2 tile_groups = glm::max(glm::ivec2(1), glm::ivec2(tile_size) / req.local_size);
+    glm::ivec2 tile_count = (req.workgroups + tile_groups - 1) / tile_groups;
+    tiles.clear();
+    for(int y = 0; y < tile_count.y; y++)
+        for(int x = 0; x < tile_count.x; x++)
+            tiles.push_back(glm::ivec2(x, y) * tile_groups);
+
+    glm::vec2 center = glm::vec2(req.workgroups) * 0.5f;
+    std::sort(tiles.begin(), tiles.end(), [&](const glm::ivec2& a, const glm::ivec2& b)
+    {
+        glm::vec2 da = glm::vec2(a) + glm::vec2(tile_groups) * 0.5f - center;
+        glm::vec2 db = glm::vec2(b) + glm::vec2(tile_groups) * 0.5f - center;
+        return da.x * da.x + da.y * da.y < db.x * db.x + db.y * db.y;
+    });
+
+    /* Tiles are submitted in slices that should take about slice_budget_ms on the GPU, estimated from the previous
+     * slices. Only this thread waits for a slice, the UI keeps showing the last published target meanwhile. A newer
+     * request abandons the frame between slices, it starts over from the center with the new view.
+     */
+    size_t done = 0;
+    int packed_scale = (int) (req.render_scale * 256.0f) << 1;
+    float slices_ms = 0.0f;
+    gpu_timer.begin("raymarch");
+    while(done < tiles.size())
+    {
+        int count = (int) std::min<float>(tiles.size() - done, std::max(1.0f, req.slice_budget_ms / tile_ms));
+        double slice_start = glfwGetTime();
+        gpu_timer.begin("slice");
+        for(size_t i = done; i < done + count; i++)
+        {
+            glm::ivec2 groups = glm::min(tile_groups, req.workgroups - tiles[i]);
+            glm::ivec2 offset = req.tile_offset + tiles[i] * req.local_size;
+            glUniform2i(13, offset.x, offset.y);
+            glDispatchCompute(groups.x, groups.y, 1);
+        }
+        gpu_timer.end("slice");
+        fenceSlot(slot);
+        done += count;
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+        if(!waitForGPU())
+            return;
+
+        //The slice is done so its timestamps are ready, wall time is only the fallback if the driver disagrees.
+        float slice_ms = gpu_timer.getLatest("slice");
+        if(slice_ms < 0.0f)
+            slice_ms = (float) ((glfwGetTime() - slice_start) * 1000.0);
+        tile_ms = 0.75f * tile_ms + 0.25f * slice_ms / count;
+        slices_ms += slice_ms;
+
+        if(done < tiles.size())
+        {
+            front_info = back | packed_scale;
+            if(mailbox >= 0)
+            {
+                cancelled_frames++;
+                break;
+            }
+        }
+    }
+    gpu_timer.end("raymarch");
+
+    /* Abandoned frames still report a time, extrapolated from the finished tiles, so the resolution controller gets
+     * feedback even while every frame is replaced by a newer one.
+     */
+    if(done > 0)
+    {
+        std::lock_guard<std::mutex> lock(timing_mutex);
+        frame_ms = slices_ms * tiles.size() / done;
+        frame_scale = req.render_scale;
+        is_frame_timed = true;
+    }
+
+    bool is_complete = (done == tiles.size());
+    if(is_complete && req.copy_history)
+    {
+        glCopyImageSubData(res.targets[back], GL_TEXTURE_2D, 0, 0, 0, 0, res.history_tex, GL_TEXTURE_2D, 0, 0, 0, 0, res.target_size.x, res.target_size.y, 1);
+        history_world_mat = req.world_mat;
+    }
+    if(!waitForGPU())
+        return;
+    front_info = back | packed_scale;
+    if(!is_complete)
+        return;
+
+    GLuint counters[2] = {0, 0};
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, res.stats_ssbo);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    samples_per_ray = (counters[1] > 0) ? (float) counters[0] / counters[1] : 0.0f;
+}
+
+/* Every slice of the light volume reads the one before it towards the light, so they are dispatched one at a time with
+ * a barrier in between. Runs before the first tile of the frame, newer requests carry the same or a newer version so
+ * an abandoned frame doesn't lose the update.
+ */
+void RenderThread::updateLightVolume(const Request& req, GpuTimer& gpu_timer)
+{
+    int axis = req.light_sweep.x;
+    int u_axis = (axis + 1) % 3, v_axis = (axis + 2) % 3;
+    glm::ivec2 groups = (glm::ivec2(req.light_size[u_axis], req.light_size[v_axis]) + req.local_size - 1) / req.local_size;
+
+    gpu_timer.begin("light");
+    glUseProgram(req.light_program_ID);
+    glBindImageTexture(1, res.light_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R16F);
+    for(int slice = 0; slice < req.light_size[axis]; slice++)
+    {
+        glUniform3i(14, req.light_sweep.x, req.light_sweep.y, slice);
+        glDispatchCompute(groups.x, groups.y, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+    gpu_timer.end("light");
+    glUseProgram(req.program_ID);
+    light_version = req.light_version;
+}
+
+//Replaces the fence of the slot, the commands submitted so far are the ones reading its RenderState.
+void RenderThread::fenceSlot(int slot)
+{
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    glDeleteSync(slot_fences[slot].exchange(fence));
+}
+
+//Blocks until the submitted commands are done, returns false if the thread is stopped meanwhile.
+bool RenderThread::waitForGPU()
+{
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    GLenum status = GL_TIMEOUT_EXPIRED;
+    while(!is_stopping && status == GL_TIMEOUT_EXPIRED)
+        status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000);
+    glDeleteSync(fence);
+    return !is_stopping;
+}
@@ -4,35 +4,122 @@
 #include <iostream>
 #include <fstream>
 #include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <sys/stat.h>
+
+#if defined (WIN32) || defined (_WIN32) || defined (__WIN32)
+#ifndef NOMINMAX
+    #define NOMINMAX
+#endif
+#include <direct.h>
+#include "Dirent/dirent.h"
+#else
+#include <dirent.h>
+#endif // defined (WIN32) || defined (_WIN32)
 
 #include "glad/glad.h"
+#include "GLFW/glfw3.h"
 #include "RendererCore.h"
+#include "glm/glm.hpp"
 #include "pvm2raw.h"
 #include "stb_image_write.h"
 
+namespace
+{
+    //FNV-1a, stable across runs and compilers unlike std::hash.
+    uint64_t hashString(const std::string& str, uint64_t hash = 14695981039346656037ULL)
+    {
+        for(size_t i = 0; i < str.size(); i++)
+        {
+            hash ^= (unsigned char) str[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    const std::string shader_cache_dir = "shadercache/";
+
+    void makeDirectory(const std::string& path)
+    {
+#if defined (WIN32) || defined (_WIN32) || defined (__WIN32)
+        _mkdir(path.c_str());
+#else
+        mkdir(path.c_str(), 0755);
+#endif
+    }
+}
+
 RendererCore::RendererCore() : main_cam(30), histogram(256,0.0f)
 {
+    //Background results wake the UI loop, which sleeps without a timeout when idle.
+    volume_stats.on_refined = []{ glfwPostEmptyEvent(); };
+    occlusion.on_done = []{ glfwPostEmptyEvent(); };
     voxel_size = glm::vec3(1.0f, 1.0f, 1.0f);
     tex3D_dim = glm::vec3(0, 0, 0);
     cs_ID = cs_programID = 0;
     alpha_scale = 1;
+    sampling_rate = 1;
+    samples_per_ray = 0;
     min_val = 0;
     max_val = 0;
     datasize_bytes = -1;
-    kerneltime_sum = 0.0;
-    camera_ubo_ID = 0;
+    stats_ssbo_ID = 0;
+    render_state = RenderState();
+    fbo_ID = history_tex2D = 0;
+    render_targets[0] = render_targets[1] = 0;
+    target_format = GL_RGBA16F;
+    render_context = NULL;
     workgroups_x = workgroups_y = 0;
+    dispatched_x = dispatched_y = 0;
+    local_size = glm::ivec2(16, 16);
     use_mip = rotate_to_bottom = rotate_to_top = false;
+    use_adaptive_sampling = true;
+    use_preintegration = false;
+    volume_filter = FILTER_HARDWARE;
+    use_shading = is_gradient_valid = false;
+    gradient_source = GRADIENT_CENTRAL;
+    gradient_kernel = GradientVolume::KERNEL_CENTRAL;
+    material = glm::vec4(0.3f, 0.7f, 0.3f, 32.0f);
+    light_azimuth = 45.0f;
+    light_elevation = 30.0f;
+    shading_threshold = 0.01f;
+    gradient_ms = 0.0f;
+    gradient_tex3D = light_tex3D = occlusion_tex3D = 0;
+    use_occlusion = is_occlusion_valid = false;
+    occlusion_version = -1;
+    resetClipping();
+    use_shadows = false;
+    light_version = 0;
+    light_size = glm::ivec3(1, 1, 1);
+    is_dirty = true;
+    skipped_frames = 0;
+    use_interaction_lowres = true;
+    interaction_scale = 2;
+    render_scale = dynamic_scale = 1.0f;
+    use_dynamic_res = false;
+    kernel_budget_ms = 12.0f;
+    refine_delay = 0.25f;
+    interaction_time = 0.0;
+    use_temporal_accum = true;
+    is_program_cached = false;
+    program_build_ms = 0.0f;
+    prefilter_ms = 0.0f;
+    slice_budget_ms = 8.0f;
+    accum_frame = 0;
+    max_accum_frames = 32;
 }
 
 RendererCore::~RendererCore()
 {
-    if(cs_programID)
-        glDeleteProgram(cs_programID);
+    render_thread.stop();
+    clearProgramCache();
 }
 
-void RendererCore::setup()
+void RendererCore::setup(GLFWwindow* render_context)
 {
+    this->render_context = render_context;
     setupFBO();
     glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo_ID);
     glReadBuffer(GL_COLOR_ATTACHMENT0);
@@ -41,6 +128,73 @@ void RendererCore::setup()
 
     //Setup a texture and load data later..
     glGenTextures(1, &vol_tex3D);
+    glGenTextures(1, &gradient_tex3D);
+    glGenTextures(1, &light_tex3D);
+    glGenTextures(1, &occlusion_tex3D);
+    glGenTextures(1, &macrocell_tex3D);
+    glGenTextures(1, &tf_tex1D);
+    glGenTextures(1, &preint_tex2D);
+    glGenTextures(1, &opacity_range_tex2D);
+
+    //Sample and ray counters written by the shader, used to report average samples per ray.
+    glGenBuffers(1, &stats_ssbo_ID);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, stats_ssbo_ID);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * 2, NULL, GL_DYNAMIC_READ);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, stats_ssbo_ID);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    state_buffer.setup();
+    startRenderThread();
+}
+
+//Objects have to exist before the thread's context binds them, their contents are updated from this thread later.
+void RendererCore::startRenderThread()
+{
+    RenderThread::Resources res;
+    res.targets[0] = render_targets[0];
+    res.targets[1] = render_targets[1];
+    res.history_tex = history_tex2D;
+    res.vol_tex = vol_tex3D;
+    res.gradient_tex = gradient_tex3D;
+    res.light_tex = light_tex3D;
+    res.occlusion_tex = occlusion_tex3D;
+    res.macrocell_tex = macrocell_tex3D;
+    res.preint_tex = preint_tex2D;
+    res.tf_tex = tf_tex1D;
+    res.opacity_range_tex = opacity_range_tex2D;
+    res.state_ubo = state_buffer.getBufferID();
+    res.state_stride = state_buffer.getOffset(1);
+    res.stats_ssbo = stats_ssbo_ID;
+    res.target_size = framebuffer_size;
+    res.target_format = target_format;
+    glFinish();
+    render_thread.start(render_context, res);
+}
+
+/* Called when the window's framebuffer changes size. The render thread holds the old targets so it is stopped while
+ * they are replaced, a minimized window keeps the old ones.
+ */
+void RendererCore::resize(int width, int height)
+{
+    glm::ivec2 size(width, height);
+    if(size.x <= 0 || size.y <= 0 || size == framebuffer_size)
+        return;
+
+    render_thread.stop();
+    framebuffer_size = size;
+    setupFBO();
+    if(cs_programID)
+    {
+        workgroups_x = (framebuffer_size.x + local_size.x - 1) / local_size.x;
+        workgroups_y = (framebuffer_size.y + local_size.y - 1) / local_size.y;
+    }
+    startRenderThread();
+}
+
+void RendererCore::setTargetFormat()
+{
+    render_thread.stop();
+    setupFBO();
+    startRenderThread();
 }
 
 bool RendererCore::checkRawInfFile(std::string fn)
@@ -55,111 +209,648 @@ bool RendererCore::checkRawInfFile(std::string fn)
 
 void RendererCore::setAlpha()
 {
-    if(cs_programID)
-        glUniform1f(0, alpha_scale);
+    is_dirty = true;
+    render_state.alpha_scale = alpha_scale;
+    light_version++;
 }
 
 void RendererCore::setMinVal()
 {
+    is_dirty = true;
+    render_state.min_val = (datasize_bytes == 2) ? min_val+1000 : min_val;
+    light_version++;
+}
+
+void RendererCore::setMaxVal()
+{
+    is_dirty = true;
+    render_state.max_val = (datasize_bytes == 2) ? max_val+1000 : max_val;
+    light_version++;
+}
+
+void RendererCore::setMIP()
+{
+    is_dirty = true;
+    if(cs_programID)
+        selectProgram();
+}
+
+void RendererCore::setSamplingRate()
+{
+    is_dirty = true;
+    render_state.sampling_rate = sampling_rate;
+}
+
+void RendererCore::setAdaptiveSampling()
+{
+    is_dirty = true;
     if(cs_programID)
+        selectProgram();
+}
+
+void RendererCore::setPreIntegration()
+{
+    is_dirty = true;
+    if(cs_programID)
+        selectProgram();
+}
+
+//Hardware filtering needs a UNORM texture, cubic the B-spline coefficients and the others the integer one, so the volume is uploaded again.
+void RendererCore::setVolumeFilter()
+{
+    is_dirty = true;
+    if(volume_data)
+        uploadVolume();
+    if(cs_programID)
+        selectProgram();
+}
+
+void RendererCore::setGradientKernel()
+{
+    is_dirty = true;
+    is_gradient_valid = false;
+    updateGradientVolume();
+}
+
+void RendererCore::setOcclusion()
+{
+    is_dirty = true;
+    occlusion_version = -1;
+    if(cs_programID)
+        selectProgram();
+}
+
+void RendererCore::resetClipping()
+{
+    for(int i = 0; i < max_clip_planes; i++)
     {
-        if(datasize_bytes == 2)
-            glUniform1i(2, min_val+1000);
-        else
-            glUniform1i(2, min_val);
+        clip_planes[i].is_enabled = false;
+        clip_planes[i].orientation = i;
+        clip_planes[i].azimuth = clip_planes[i].elevation = 0.0f;
+        clip_planes[i].offset = 1.0f;
     }
+    crop_min = glm::vec3(0.0f);
+    crop_max = glm::vec3(1.0f);
+    setClipping();
 }
 
-void RendererCore::setMaxVal()
+/* Only the enabled planes are packed into the RenderState, so the shader loops over num_clip_planes. The axis
+ * orientations are +X, -X, +Y, -Y, +Z, -Z, anything above uses the angles like the light direction.
+ */
+void RendererCore::setClipping()
 {
-    if(cs_programID)
+    is_dirty = true;
+    glm::vec3 half_size = glm::abs(getBoxHalfSize());
+    int count = 0;
+    for(int i = 0; i < max_clip_planes; i++)
     {
-        if(datasize_bytes == 2)
-            glUniform1i(3, max_val+1000);
+        const ClipPlane& plane = clip_planes[i];
+        if(!plane.is_enabled)
+            continue;
+
+        glm::vec3 normal(0.0f);
+        if(plane.orientation < 6)
+            normal[plane.orientation / 2] = (plane.orientation % 2 == 0) ? 1.0f : -1.0f;
         else
-            glUniform1i(3, max_val);
+        {
+            float azimuth = glm::radians(plane.azimuth);
+            float elevation = glm::radians(plane.elevation);
+            normal = glm::vec3(std::cos(elevation) * std::sin(azimuth), std::sin(elevation), std::cos(elevation) * std::cos(azimuth));
+        }
+        // Offsets of +-1 touch the box, whatever the orientation.
+        float extent = glm::dot(glm::abs(normal), half_size);
+        render_state.clip_planes[count++] = glm::vec4(normal, plane.offset * extent);
     }
+    render_state.num_clip_planes = count;
+    render_state.crop_min = glm::vec4(crop_min, 0.0f);
+    render_state.crop_max = glm::vec4(crop_max, 0.0f);
 }
 
-void RendererCore::setMIP()
+void RendererCore::setShading()
 {
+    is_dirty = true;
+    light_version++;
+    updateGradientVolume();
     if(cs_programID)
-        glUniform1i(4, (use_mip) ? 1 : 0);
+        selectProgram();
+}
+
+//The light is fixed to the volume rather than the camera, azimuth turns around the up axis.
+void RendererCore::setLighting()
+{
+    is_dirty = true;
+    float azimuth = glm::radians(light_azimuth);
+    float elevation = glm::radians(light_elevation);
+    render_state.light_dir = glm::vec4(std::cos(elevation) * std::sin(azimuth), std::sin(elevation), std::cos(elevation) * std::cos(azimuth), 0.0f);
+    render_state.material = material;
+    render_state.shading_threshold = shading_threshold;
+    light_version++;
+}
+
+//The target size is written to the RenderState with every request.
+void RendererCore::setRenderScale()
+{
+    is_dirty = true;
 }
 
+/* Feedback controller for the interaction resolution. The cost of a frame is roughly proportional to its pixel count,
+ * so the scale that fits the budget is the measured scale times sqrt(measured / budget). Moves half way there every
+ * frame and is rounded to 1/8 steps, so the uniform doesn't change for every small variation in the timings.
+ */
+void RendererCore::updateDynamicScale()
+{
+    float gpu_ms, frame_scale;
+    if(!render_thread.getFrameTime(gpu_ms, frame_scale) || gpu_ms <= 0.0f)
+        return;
+
+    float ideal_scale = frame_scale * std::sqrt(gpu_ms / kernel_budget_ms);
+    float scale = 0.5f * (dynamic_scale + ideal_scale);
+    dynamic_scale = glm::clamp(std::round(scale * 8.0f) / 8.0f, 1.0f, 4.0f);
+}
+
+//Size of the lower left part of the render target that is rendered at the given scale.
+glm::ivec2 RendererCore::getTargetSize(float scale)
+{
+    return glm::ivec2(glm::ceil(glm::vec2(framebuffer_size) / scale));
+}
+
+//The light is fixed to the world, rotating the volume moves it relative to the voxels.
 void RendererCore::setInitialCameraRotation()
 {
+    is_dirty = true;
+    light_version++;
+    setClipping();
     if(cs_programID)
     {
         main_cam.resetCamera();
-        glUniform1i(5, (rotate_to_top) ? 1 : 0);
-        glUniform1i(6, (rotate_to_bottom) ? 1 : 0);
+        selectProgram();
     }
 }
 
 void RendererCore::setUniforms()
 {
-    if(cs_programID)
-        glUniform3f(1, voxel_size.x, voxel_size.y, voxel_size.z);
+    applyUniforms();
+    setInitialCameraRotation();
+}
+
+//Copies the parameters into the RenderState, it is shared by all programs so switching programs doesn't need this.
+void RendererCore::applyUniforms()
+{
+    render_state.voxel_size = glm::vec4(voxel_size, 0.0f);
     setAlpha();
     setMinVal();
     setMaxVal();
-    setMIP();
-    setInitialCameraRotation();
+    setSamplingRate();
+    setRenderScale();
+    setLighting();
+    setClipping();
+}
+
+int RendererCore::getPermutation()
+{
+    int permutation = 0;
+    if(use_mip)
+        permutation |= SHADER_MIP;
+    if(rotate_to_top)
+        permutation |= SHADER_VIEW_TOP;
+    if(rotate_to_bottom)
+        permutation |= SHADER_VIEW_BOTTOM;
+    if(use_adaptive_sampling)
+        permutation |= SHADER_ADAPTIVE_SAMPLING;
+    if(use_preintegration)
+        permutation |= SHADER_PREINTEGRATION;
+    if(volume_filter == FILTER_HARDWARE)
+        permutation |= SHADER_FILTER_HW;
+    else if(volume_filter == FILTER_MANUAL)
+        permutation |= SHADER_FILTER_MANUAL;
+    else if(volume_filter == FILTER_CUBIC)
+        permutation |= SHADER_FILTER_CUBIC;
+    if(use_occlusion && !use_mip)
+        permutation |= SHADER_AMBIENT_OCCLUSION;
+    //MIP has no surfaces to shade.
+    if(use_shading && !use_mip)
+    {
+        permutation |= SHADER_SHADING;
+        if(gradient_source == GRADIENT_VOLUME)
+            permutation |= SHADER_GRADIENT_VOLUME;
+        if(use_shadows)
+            permutation |= SHADER_SHADOWS;
+    }
+    return permutation;
+}
+
+std::string RendererCore::getPermutationDefines(int permutation)
+{
+    std::string defines = "";
+    if(permutation & SHADER_MIP)
+        defines += "#define MODE_MIP\n";
+    if(permutation & SHADER_VIEW_TOP)
+        defines += "#define VIEW_TOP\n";
+    if(permutation & SHADER_VIEW_BOTTOM)
+        defines += "#define VIEW_BOTTOM\n";
+    if(permutation & SHADER_ADAPTIVE_SAMPLING)
+        defines += "#define ADAPTIVE_SAMPLING\n";
+    if(permutation & SHADER_PREINTEGRATION)
+        defines += "#define PREINTEGRATION\n";
+    if(permutation & SHADER_FILTER_HW)
+        defines += "#define VOLUME_FILTER_HW\n";
+    if(permutation & SHADER_FILTER_MANUAL)
+        defines += "#define VOLUME_FILTER_MANUAL\n";
+    if(permutation & SHADER_FILTER_CUBIC)
+        defines += "#define VOLUME_FILTER_CUBIC\n";
+    if(permutation & SHADER_SHADING)
+        defines += "#define SHADING\n";
+    if(permutation & SHADER_GRADIENT_VOLUME)
+        defines += "#define GRADIENT_VOLUME\n";
+    if(permutation & SHADER_SHADOWS)
+        defines += "#define SHADOWS\n";
+    if(permutation & SHADER_LIGHT_PASS)
+        defines += "#define LIGHT_PASS\n";
+    if(permutation & SHADER_AMBIENT_OCCLUSION)
+        defines += "#define AMBIENT_OCCLUSION\n";
+    return defines;
+}
+
+/* Programs are loaded from the on-disk binary cache when possible. The cache file name is a hash of the driver and the
+ * source followed by a hash of the permutation defines, so any change to them simply misses. Binaries the driver
+ * rejects are rebuilt.
+ */
+GLuint RendererCore::buildProgram(int permutation)
+{
+    double start_time = glfwGetTime();
+    std::string defines = getPermutationDefines(permutation);
+    std::string cache_fn = getProgramCacheFile(defines);
+
+    GLuint program_ID = loadProgramBinary(cache_fn);
+    is_program_cached = (program_ID != 0);
+    if(!program_ID)
+    {
+        if(!createShader(defines))
+            return 0;
+        program_ID = createShaderProgram();
+        if(!program_ID)
+            return 0;
+        saveProgramBinary(program_ID, cache_fn);
+    }
 
+    program_build_ms = (glfwGetTime() - start_time) * 1000.0;
+    return program_ID;
+}
+
+std::string RendererCore::getProgramCacheFile(const std::string& defines)
+{
+    std::string driver = "";
+    const GLubyte* strings[3] = {glGetString(GL_VENDOR), glGetString(GL_RENDERER), glGetString(GL_VERSION)};
+    for(int i = 0; i < 3; i++)
+    {
+        if(strings[i])
+            driver += (const char*) strings[i];
+        driver += '\n';
+    }
+
+    uint64_t source_hash = hashString(shader_source, hashString(driver));
+    std::stringstream ss;
+    ss << shader_cache_dir << std::hex << source_hash << "_" << hashString(defines) << ".bin";
+    return ss.str();
+}
+
+/* Removes the cached binaries of any other source or driver than the one of fn, they can never be loaded again. Their
+ * names don't start with the same source hash.
+ */
+void RendererCore::pruneProgramCache(const std::string& fn)
+{
+    std::string keep_prefix = fn.substr(shader_cache_dir.size(), fn.find('_', shader_cache_dir.size()) - shader_cache_dir.size() + 1);
+    DIR* dir = opendir(shader_cache_dir.c_str());
+    if(!dir)
+        return;
+
+    struct dirent* ent;
+    while((ent = readdir(dir)) != NULL)
+    {
+        std::string name = ent->d_name;
+        bool is_binary = name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0;
+        if(is_binary && name.compare(0, keep_prefix.size(), keep_prefix) != 0)
+            std::remove((shader_cache_dir + name).c_str());
+    }
+    closedir(dir);
+}
+
+GLuint RendererCore::loadProgramBinary(const std::string& fn)
+{
+    std::ifstream file(fn, std::ios::binary);
+    if(!file)
+        return 0;
+
+    GLenum format = 0;
+    GLint length = 0;
+    file.read((char*) &format, sizeof(format));
+    file.read((char*) &length, sizeof(length));
+    if(!file || length <= 0)
+        return 0;
+
+    std::vector<char> binary(length);
+    file.read(binary.data(), length);
+    if(!file)
+        return 0;
+
+    GLuint program_ID = glCreateProgram();
+    glProgramBinary(program_ID, format, binary.data(), length);
+
+    GLint isLinked = 0;
+    glGetProgramiv(program_ID, GL_LINK_STATUS, &isLinked);
+    if(isLinked == GL_FALSE)
+    {
+        glDeleteProgram(program_ID);
+        return 0;
+    }
+    return program_ID;
+}
+
+void RendererCore::saveProgramBinary(GLuint program_ID, const std::string& fn)
+{
+    GLint num_formats = 0, length = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    glGetProgramiv(program_ID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(num_formats == 0 || length <= 0)
+        return;
+
+    GLenum format = 0;
+    std::vector<char> binary(length);
+    glGetProgramBinary(program_ID, length, &length, &format, binary.data());
+
+    makeDirectory(shader_cache_dir);
+    pruneProgramCache(fn);
+    std::ofstream file(fn, std::ios::binary);
+    if(!file)
+        return;
+    file.write((const char*) &format, sizeof(format));
+    file.write((const char*) &length, sizeof(length));
+    file.write(binary.data(), length);
+}
+
+//Returns the cached program for the permutation, building it on first use. 0 if it doesn't compile.
+GLuint RendererCore::getProgram(int permutation)
+{
+    std::map<int, GLuint>::iterator it = program_cache.find(permutation);
+    if(it != program_cache.end())
+        return it->second;
+
+    GLuint program_ID = buildProgram(permutation);
+    if(program_ID)
+        program_cache[permutation] = program_ID;
+    return program_ID;
+}
+
+//Switches to the program for the current mode and features, compiling it on first use.
+bool RendererCore::selectProgram()
+{
+    GLuint program_ID = getProgram(getPermutation());
+    if(!program_ID)
+        return false;
+
+    if(program_ID != cs_programID)
+    {
+        cs_programID = program_ID;
+        glUseProgram(cs_programID);
+        is_dirty = true;
+    }
+    return true;
+}
+
+void RendererCore::clearProgramCache()
+{
+    //A queued frame may still refer to one of the programs.
+    render_thread.waitIdle();
+    for(std::map<int, GLuint>::iterator it = program_cache.begin(); it != program_cache.end(); ++it)
+        glDeleteProgram(it->second);
+    program_cache.clear();
+    cs_programID = 0;
 }
 
 bool RendererCore::loadShader(std::string fn, bool reload)
 {
-    if(createShader(fn, reload))
+    //Keep the current programs, and the shader reported as loaded, until the new source compiles for the current permutation.
+    std::string prev_source = shader_source, prev_shader = loaded_shader, prev_path = loaded_shader_path;
+    GLuint program_ID = 0;
+    if(readShaderFile(fn, reload))
+        program_ID = buildProgram(getPermutation());
+
+    if(!program_ID)
     {
-        if(createShaderProgram())
-        {
-            // get Total Workgroup count
-            int workgroup_size[3];
-            glGetProgramiv(cs_programID, GL_COMPUTE_WORK_GROUP_SIZE, workgroup_size);
-            workgroups_x = window_size.x / workgroup_size[0];
-            workgroups_y = window_size.y / workgroup_size[1];
-
-            glUseProgram(cs_programID);
-            glUniform1f(0, alpha_scale);
-            if(!loaded_dataset.empty())
-            {
-                setUniforms();
-                main_cam.resetCamera();
-            }
-            return true;
-        }
+        shader_source = prev_source;
+        loaded_shader = prev_shader;
+        loaded_shader_path = prev_path;
+        return false;
+    }
+
+    clearProgramCache();
+    program_cache[getPermutation()] = program_ID;
+    selectProgram();
+
+    // get Total Workgroup count, rounded up so the edge pixels are covered as well
+    int workgroup_size[3];
+    glGetProgramiv(cs_programID, GL_COMPUTE_WORK_GROUP_SIZE, workgroup_size);
+    local_size = glm::ivec2(workgroup_size[0], workgroup_size[1]);
+    workgroups_x = (framebuffer_size.x + local_size.x - 1) / local_size.x;
+    workgroups_y = (framebuffer_size.y + local_size.y - 1) / local_size.y;
+
+    if(!loaded_dataset.empty())
+    {
+        setUniforms();
+        main_cam.resetCamera();
     }
-    loaded_shader.clear();
-    return false;
+
+    int idx = fn.find_last_of("/");
+    loaded_shader = fn.substr(idx+1, fn.length() - idx);
+    title = "Shader Loaded!";
+    msg = "Shader Loaded Successfully!";
+    return true;
 }
 
 void RendererCore::render()
 {
-    GLuint64 elapsed_time = 0;
-    GLuint query;
-    glGenQueries(1, &query);
+    /* While the camera or the transfer function keep changing, rays are only cast for every interaction_scale-th pixel,
+     * or at the scale picked by the controller to stay within kernel_budget_ms, and the result is stretched by the blit.
+     * Once idle for refine_delay seconds the view is rendered again at full resolution.
+     */
+    double current_time = glfwGetTime();
+    if(main_cam.is_changed)
+        interaction_time = current_time;
+    updateDynamicScale();
+    float scale = 1.0f;
+    if(use_interaction_lowres && current_time - interaction_time < refine_delay)
+        scale = (use_dynamic_res) ? dynamic_scale : interaction_scale;
+    if(scale != render_scale)
+    {
+        render_scale = scale;
+        setRenderScale();
+    }
+
+    /* Nothing affecting the image changed and the accumulated image has converged, just show the previous result again.
+     * Accumulation frames are only queued once the render thread is done, a changed view replaces whatever is queued.
+     */
+    bool is_accumulating = use_temporal_accum && render_scale == 1.0f;
+    if(!is_dirty && !main_cam.is_changed && (!is_accumulating || accum_frame >= max_accum_frames || render_thread.isBusy()))
+    {
+        skipped_frames++;
+        blitFBO();
+        return;
+    }
+
+    /* Small camera moves keep a short history that is reprojected into the new view, anything else starts over. The
+     * render thread knows which camera the history was actually rendered with and reprojects from that one.
+     */
+    if(!is_accumulating || is_dirty)
+        accum_frame = 0;
+    else if(main_cam.is_changed)
+    {
+        bool is_small_move = accum_frame > 0 && glm::length(main_cam.eye - prev_eye) < 0.05f * glm::length(prev_eye);
+        accum_frame = (is_small_move) ? std::min(accum_frame, 2) : 0;
+    }
+    is_dirty = false;
 
     if(main_cam.is_changed)
-        setupUBO(true);
+    {
+        prev_eye = main_cam.eye;
+        main_cam.setUBO(render_state.camera);
+    }
+
+    //Pixels outside the volume's screen bounds are only cleared, the dispatch covers the bounds in whole workgroups.
+    glm::ivec2 rect_min, rect_max;
+    getScreenBounds(rect_min, rect_max);
+    rect_min = (rect_min / local_size) * local_size;
+    dispatched_x = std::max(0, (rect_max.x - rect_min.x + local_size.x - 1) / local_size.x);
+    dispatched_y = std::max(0, (rect_max.y - rect_min.y + local_size.y - 1) / local_size.y);
+
+    render_state.target_size = getTargetSize(render_scale);
+    render_state.accum_frame = (is_accumulating) ? accum_frame : -1;
+
+    int slot = render_thread.acquireSlot();
+    state_buffer.upload(slot, render_state);
+
+    RenderThread::Request& req = render_thread.getRequest(slot);
+    req.program_ID = cs_programID;
+    req.tile_offset = rect_min;
+    req.workgroups = glm::ivec2(dispatched_x, dispatched_y);
+    req.local_size = local_size;
+    req.slice_budget_ms = slice_budget_ms;
+    req.render_scale = render_scale;
+    req.target_size = render_state.target_size;
+    req.copy_history = is_accumulating;
+    req.world_mat = glm::inverse(render_state.camera.view_mat);
+    req.light_program_ID = 0;
+    if(getPermutation() & SHADER_SHADOWS)
+    {
+        //The sweep samples the volume the same way as the raymarcher, so it shares its view and filter defines.
+        const int shared_bits = SHADER_VIEW_TOP | SHADER_VIEW_BOTTOM | SHADER_FILTER_HW | SHADER_FILTER_MANUAL | SHADER_FILTER_CUBIC;
+        req.light_program_ID = getProgram((getPermutation() & shared_bits) | SHADER_LIGHT_PASS);
+        req.light_version = light_version;
+        req.light_size = light_size;
+        req.light_sweep = getLightSweep();
+    }
+
+    //The render thread waits on the fence on the GPU, so the texture and RenderState updates above land first.
+    req.state_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    render_thread.submit(slot);
+    if(is_accumulating)
+        accum_frame++;
+    blitFBO();
+}
+
+//Half the size of the volume's bounding box in world space, set up the same way as in the shader.
+glm::vec3 RendererCore::getBoxHalfSize()
+{
+    glm::vec3 dim = glm::vec3(tex3D_dim), spacing = voxel_size;
+    if(rotate_to_top || rotate_to_bottom)
+    {
+        dim = glm::vec3(dim.x, dim.z, dim.y);
+        spacing = glm::vec3(spacing.x, spacing.z, spacing.y);
+    }
+    return dim / std::max(dim.x, std::max(dim.y, dim.z)) * spacing * 0.5f;
+}
+
+/* The light volume is swept along the axis the light direction is most aligned with, measured in light volume voxels so
+ * the lookup into the previous slice moves at most one voxel sideways. Mirrors cartesianToTextureCoord in the shader.
+ */
+glm::ivec2 RendererCore::getLightSweep()
+{
+    glm::vec3 dir = glm::vec3(render_state.light_dir) / (2.0f * getBoxHalfSize());
+    if(rotate_to_top)
+        dir = glm::vec3(dir.x, dir.z, dir.y);
+    else if(rotate_to_bottom)
+        dir = glm::vec3(dir.x, -dir.z, -dir.y);
+    else
+        dir.z = -dir.z;
+    dir *= glm::vec3(light_size);
 
-    glBindImageTexture(0, fbo_texID, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glm::vec3 len = glm::abs(dir);
+    int axis = (len.x >= len.y && len.x >= len.z) ? 0 : ((len.y >= len.z) ? 1 : 2);
+    return glm::ivec2(axis, (dir[axis] >= 0.0f) ? 1 : -1);
+}
 
-    glBeginQuery(GL_TIME_ELAPSED, query);
-    glDispatchCompute(workgroups_x, workgroups_y, 1);
-    glEndQuery(GL_TIME_ELAPSED);
-    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed_time);
-    kerneltime_sum += (double) elapsed_time/1000000.0;
+/* Screen space rectangle [rect_min, rect_max) covered by the volume's bounding box in render target pixels. The box is
+ * set up the same way as in the shader, centered at the origin and scaled by the voxel spacing.
+ */
+void RendererCore::getScreenBounds(glm::ivec2& rect_min, glm::ivec2& rect_max)
+{
+    glm::ivec2 target_size = getTargetSize(render_scale);
+    glm::vec2 pix_scale = glm::vec2(target_size) / glm::vec2(framebuffer_size);
+    rect_min = glm::ivec2(0, 0);
+    rect_max = target_size;
 
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-    glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    //Only the crop box is dispatched, the clip planes are left to the shader.
+    glm::vec3 half_len = getBoxHalfSize();
+    glm::vec3 box_min = glm::mix(-half_len, half_len, crop_min), box_max = glm::mix(-half_len, half_len, crop_max);
 
-    glBlitFramebuffer(0, 0, framebuffer_size.x, framebuffer_size.y,
+    glm::vec2 pix_min(1e30f), pix_max(-1e30f);
+    for(int i = 0; i < 8; i++)
+    {
+        glm::vec3 corner((i & 1) ? box_max.x : box_min.x, (i & 2) ? box_max.y : box_min.y, (i & 4) ? box_max.z : box_min.z);
+        glm::vec2 pix;
+        //A corner behind the camera means the box can cover any part of the screen.
+        if(!main_cam.projectToScreen(corner, framebuffer_size, pix))
+            return;
+        pix_min = glm::min(pix_min, pix);
+        pix_max = glm::max(pix_max, pix);
+    }
+
+    //One pixel margin for the jittered rays.
+    rect_min = glm::clamp(glm::ivec2(glm::floor(pix_min * pix_scale)) - 1, glm::ivec2(0), target_size);
+    rect_max = glm::clamp(glm::ivec2(glm::ceil(pix_max * pix_scale)) + 1, glm::ivec2(0), target_size);
+}
+
+/* Shows the last frame the render thread finished, at the scale it was rendered with. The target is attached again
+ * every time, changes made by another context are only guaranteed to be visible after the object is rebound.
+ */
+void RendererCore::blitFBO()
+{
+    float src_scale = 1.0f;
+    int front = render_thread.beginBlit(src_scale);
+    glm::ivec2 src_size = getTargetSize(src_scale);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, render_targets[front], 0);
+    gpu_timer.begin("blit");
+    glBlitFramebuffer(0, 0, src_size.x, src_size.y,
                       0, 0, framebuffer_size.x, framebuffer_size.y,
                       GL_COLOR_BUFFER_BIT,
-                      GL_LINEAR
+                      (src_size == framebuffer_size) ? GL_NEAREST : GL_LINEAR
                       );
+    gpu_timer.end("blit");
+    render_thread.endBlit(glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+}
+
+//Whether render() still has frames to produce without any further input, e.g. refining or accumulating.
+bool RendererCore::hasPendingWork()
+{
+    if(is_dirty || main_cam.is_changed || render_scale != 1.0f || render_thread.isBusy())
+        return true;
+    return use_temporal_accum && accum_frame < max_accum_frames;
+}
+
+void RendererCore::updateSampleStats()
+{
+    //The render thread reads the counters back after every frame, it already waits for the GPU anyway.
+    samples_per_ray = render_thread.samples_per_ray;
 }
 
 bool RendererCore::saveImage(std::string fn, std::string ext)
@@ -181,22 +872,42 @@ bool RendererCore::saveImage(std::string fn, std::string ext)
     return status;
 }
 
+/* (Re)allocates the render targets from the pool for the current size and format. Both targets the render thread
+ * alternates between and the history of the accumulated frames, low-res frames use the lower left part of them. With
+ * GL_RGBA8 the targets match the default framebuffer, so the blit is a plain copy instead of a float conversion.
+ */
 void RendererCore::setupFBO()
 {
-    glGenFramebuffers(1,&fbo_ID);
+    is_dirty = true;
+    accum_frame = 0;
+    if(!fbo_ID)
+        glGenFramebuffers(1,&fbo_ID);
     glBindFramebuffer(GL_FRAMEBUFFER,fbo_ID);
 
-    glGenTextures(1, &fbo_texID);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, fbo_texID);
+    if(history_tex2D)
+    {
+        target_pool.release(render_targets[0]);
+        target_pool.release(render_targets[1]);
+        target_pool.release(history_tex2D);
+    }
+    target_pool.trim(framebuffer_size);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, framebuffer_size.x, framebuffer_size.y, 0, GL_RGBA, GL_FLOAT,0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    //The render thread draws into one target while the other one is shown.
+    const GLfloat clear_color[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for(int i = 0; i < 2; i++)
+    {
+        render_targets[i] = target_pool.acquire(framebuffer_size, target_format);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, render_targets[i], 0);
+        glClearBufferfv(GL_COLOR, 0, clear_color);
+    }
 
-    glBindTexture(GL_TEXTURE_2D, 0);
+    //Copy of the last frame that new frames are blended with, stays bound to unit 5.
+    history_tex2D = target_pool.acquire(framebuffer_size, target_format);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D, history_tex2D);
+    glActiveTexture(GL_TEXTURE0);
 
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fbo_texID, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, render_targets[0], 0);
     GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
 
     if(status != GL_FRAMEBUFFER_COMPLETE)
@@ -216,33 +927,17 @@ void RendererCore::setupFBO()
         else
             throw std::runtime_error("Framebuffer not complete.");
     }
-}
-
-void RendererCore::setupUBO(bool is_update)
-{
-    std::vector<float> cam_data;
-    cam_data.clear();
-    main_cam.setUBO(cam_data);
-    bool is_init = false;
-    if(!is_update || camera_ubo_ID == 0)
-        is_init = true;
-
-    if(is_init)
-        glGenBuffers(1, &camera_ubo_ID);
-
-    glBindBuffer(GL_UNIFORM_BUFFER, camera_ubo_ID);
-    glBufferData(GL_UNIFORM_BUFFER, sizeof(float)*cam_data.size(), cam_data.data(), GL_DYNAMIC_DRAW);
-
-    if(is_init)
-        glBindBufferBase(GL_UNIFORM_BUFFER, 1, camera_ubo_ID);
 
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    //Stays the read framebuffer for the blit, the window is drawn to directly.
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 }
 
 void RendererCore::readVolumeData(std::string fn)
 {
     std::string ext = fn.substr(fn.length()-3, 3);
-    void* volume_data = NULL;
+    volume_stats.cancel();
+    volume_data.reset();
+    std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>();
 
     if(ext == "raw")
     {
@@ -324,7 +1019,7 @@ void RendererCore::readVolumeData(std::string fn)
             title = "Error!";
             return;
         }
-        int len = tex3D_dim.x * tex3D_dim.y * tex3D_dim.z;
+        size_t len = (size_t)tex3D_dim.x * tex3D_dim.y * tex3D_dim.z;
 
         if(len == 0)
         {
@@ -334,79 +1029,151 @@ void RendererCore::readVolumeData(std::string fn)
         }
 
         //Read RAW file into byte array;
-        if(datasize_bytes == 1)
-            volume_data = (uint8_t*) new uint8_t[len]();
-        else
-            volume_data = (uint16_t*) new uint16_t[len]();
-        raw_file.read((char*)volume_data, len * datasize_bytes);
+        data->resize(len * datasize_bytes);
+        raw_file.read((char*)data->data(), data->size());
     }
     else
     {
         unsigned int components = -1;
         glm::uvec3 dims(0, 0, 0);
-        volume_data = readPVMvolume(fn.c_str(), &dims.x, &dims.y, &dims.z, &components, &voxel_size.x, &voxel_size.y, &voxel_size.z);
+        unsigned char* pvm_data = readPVMvolume(fn.c_str(), &dims.x, &dims.y, &dims.z, &components, &voxel_size.x, &voxel_size.y, &voxel_size.z);
         tex3D_dim = glm::ivec3(dims.x, dims.y, dims.z);
-        if(!volume_data)
+        if(!pvm_data)
         {
             msg = "Error reading PVM file";
             title = "Error!";
             return;
         }
+        data->assign(pvm_data, pvm_data + (size_t)tex3D_dim.x * tex3D_dim.y * tex3D_dim.z * datasize_bytes);
+        free(pvm_data);
     }
 
     std::cout << "Dataset dimensions: " << tex3D_dim.x << ", " << tex3D_dim.y << ", " << tex3D_dim.z << std::endl;
     std::cout << "Dataset Aspect ratio: " << voxel_size.x << ", " << voxel_size.y << ", " << voxel_size.z << std::endl;
 
-    //Calculate Histogram
-    int max_value = -1, min_value = 9000000, len = tex3D_dim.x * tex3D_dim.y * tex3D_dim.z;
-    if(datasize_bytes == 2)
+    //Approximate statistics from a sample are available right away, the exact ones are computed in the background.
+    volume_stats.compute(data, datasize_bytes);
+    applyStatistics(true);
+
+    volume_data = data;
+    uploadVolume();
+    is_gradient_valid = false;
+    updateGradientVolume();
+    setupLightVolume();
+    is_occlusion_valid = false;
+    is_dirty = true;
+
+    title = "File Loaded!";
+    msg = "File Loaded Successfully!";
+
+    if(!loaded_shader.empty())
     {
-        for(int i = 0; i < len; i++)
-        {
-            if(i == 8390640)
-                continue;
-           uint16_t val = (((uint16_t*)(volume_data))[i]);
-
-            if(val > max_value)
-                max_value = val;
-            if(val < min_value)
-                min_value = val;
-        }
-        max_val = max_value;
-        max_dataset_val = max_value;
-        min_val = min_value;
-        min_dataset_val = min_value;
+        setUniforms();
+        main_cam.resetCamera();
     }
+
+    int idx = fn.find_last_of("/");
+    loaded_dataset =  fn.substr(idx+1, fn.length() - idx);
+}
+
+/* Integer textures can't be filtered by the texture unit, they are sampled nearest neighbour or interpolated in the
+ * shader. For hardware filtering the same data is uploaded as UNORM, value_range maps the samples back to raw values.
+ * Cubic filtering replaces the volume with its B-spline coefficients, also normalized, R16F keeps enough precision for
+ * 8 bit data. They are prefiltered every time the mode is selected rather than kept around at 4 bytes per voxel. The
+ * macrocells follow the filter, the cubic reconstruction reaches further and overshoots the voxel values.
+ */
+void RendererCore::uploadVolume()
+{
+    //The render thread may still be sampling the old texture.
+    render_thread.waitIdle();
+    bool is_cubic = (volume_filter == FILTER_CUBIC);
+    bool is_normalized = (volume_filter == FILTER_HARDWARE) || is_cubic;
+    GLenum internal_format, data_type;
+    if(is_cubic)
+        internal_format = (datasize_bytes == 1) ? GL_R16F : GL_R32F;
+    else if(datasize_bytes == 1)
+        internal_format = (is_normalized) ? GL_R8 : GL_R8UI;
     else
+        internal_format = (is_normalized) ? GL_R16 : GL_R16UI;
+    render_state.value_range = (datasize_bytes == 1) ? 255.0f : 65535.0f;
+    light_version++;
+
+    const void* data = volume_data->data();
+    data_type = (datasize_bytes == 1) ? GL_UNSIGNED_BYTE : GL_UNSIGNED_SHORT;
+    if(is_cubic)
     {
-        min_val = min_dataset_val = 0;
-        max_val = max_dataset_val = 255;
+        double start_time = glfwGetTime();
+        bspline.build(*volume_data, datasize_bytes, tex3D_dim, render_state.value_range);
+        prefilter_ms = (glfwGetTime() - start_time) * 1000.0;
+        data = bspline.coeffs.data();
+        data_type = GL_FLOAT;
+        macrocells.build(bspline, render_state.value_range);
     }
+    else
+        macrocells.build(*volume_data, datasize_bytes, tex3D_dim);
+    uploadMacrocells();
 
-    for(int i = 0; i < len; i++)
-    {
-        uint16_t val = 0;
-        if(datasize_bytes == 1)
-            val = (((uint8_t*)(volume_data))[i]);
-        else
-        {
-            val = (((uint16_t*)(volume_data))[i]);
-            val = std::round(val * 255.0f/max_dataset_val);
-        }
-        if(val == 0)
-            continue;
-        histogram[val]++;
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, vol_tex3D);
 
-        if(histogram[val] > max_value)
-            max_value = histogram[val];
-    }
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, (is_normalized) ? GL_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, (is_normalized) ? GL_LINEAR : GL_NEAREST);
+
+    if(tex3D_dim.x % 4 != 0)
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_3D, 0, internal_format, tex3D_dim.x, tex3D_dim.y, tex3D_dim.z, 0, (is_normalized) ? GL_RED : GL_RED_INTEGER, data_type, data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    bspline.clear();
+}
+
+/* The gradient volume is only built once it is used and then kept for the dataset, it costs 3 bytes per voxel of VRAM.
+ * Central differences need no memory but take 6 volume samples per shaded sample. Each slab is uploaded as soon as it
+ * is computed, so the CPU side never holds more than one slab of gradients.
+ */
+void RendererCore::updateGradientVolume()
+{
+    if(!use_shading || gradient_source != GRADIENT_VOLUME || is_gradient_valid || !volume_data)
+        return;
+
+    render_thread.waitIdle();
+    double start_time = glfwGetTime();
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_3D, gradient_tex3D);
+
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
-    for(int i = 0; i < histogram.size(); i++)
-        histogram[i] = histogram[i] * 100.0f / max_value;
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB8, tex3D_dim.x, tex3D_dim.y, tex3D_dim.z, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
 
-    //Upload data from array to 3D texture
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    gradient_volume.setup(*volume_data, datasize_bytes, tex3D_dim, render_state.value_range, gradient_kernel);
+    for(int z = 0; z < tex3D_dim.z; z += GradientVolume::slab_size)
+    {
+        int depth = gradient_volume.buildSlab(z);
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, z, tex3D_dim.x, tex3D_dim.y, depth, GL_RGB, GL_UNSIGNED_BYTE, gradient_volume.slab.data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
     glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_3D, vol_tex3D);
+    gradient_volume.clear();
+    gradient_ms = (glfwGetTime() - start_time) * 1000.0;
+    is_gradient_valid = true;
+}
+
+/* Transmittance towards the light at half the volume's resolution, filled by the render thread's light pass. Every slice
+ * multiplies the previous one, in 8 bits the rounding error compounds over the sweep and bands the shadows, R16F doesn't.
+ */
+void RendererCore::setupLightVolume()
+{
+    light_size = glm::max((tex3D_dim + 1) / 2, glm::ivec3(1));
+    light_version++;
+    glActiveTexture(GL_TEXTURE7);
+    glBindTexture(GL_TEXTURE_3D, light_tex3D);
 
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -414,46 +1181,215 @@ void RendererCore::readVolumeData(std::string fn)
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
-    if(tex3D_dim.x % 4 != 0)
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexImage3D(GL_TEXTURE_3D, 0, (datasize_bytes == 1) ? GL_R8UI : GL_R16UI, tex3D_dim.x, tex3D_dim.y, tex3D_dim.z, 0, GL_RED_INTEGER, (datasize_bytes == 1) ? GL_UNSIGNED_BYTE : GL_UNSIGNED_SHORT, volume_data);
-    if(ext == "pvm")
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R16F, light_size.x, light_size.y, light_size.z, 0, GL_RED, GL_HALF_FLOAT, NULL);
+    glActiveTexture(GL_TEXTURE1);
+}
+
+void RendererCore::uploadMacrocells()
+{
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_3D, macrocell_tex3D);
+
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RG16UI, macrocells.grid_dim.x, macrocells.grid_dim.y, macrocells.grid_dim.z, 0, GL_RG_INTEGER, GL_UNSIGNED_SHORT, macrocells.cells.data());
+    glActiveTexture(GL_TEXTURE1);
+}
+
+void RendererCore::updateTransferFunction(const std::vector<glm::vec4>& tf_table)
+{
+    //Only the range of entries that differ from the last upload is sent to the LUT texture.
+    int lut_size = tf_table.size();
+    glActiveTexture(GL_TEXTURE4);
+    glBindTexture(GL_TEXTURE_1D, tf_tex1D);
+    bool is_lut_changed = true;
+    if(tf_lut.size() != lut_size)
     {
-        if(datasize_bytes == 1)
-            free((uint8_t*)volume_data);
-        else
-            free((uint16_t*)volume_data);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, lut_size, 0, GL_RGBA, GL_FLOAT, tf_table.data());
+        tf_lut = tf_table;
     }
     else
     {
-        if(datasize_bytes == 1)
-            delete[] (uint8_t*)volume_data;
+        int lo = 0, hi = lut_size - 1;
+        while(lo <= hi && tf_lut[lo] == tf_table[lo])
+            lo++;
+        while(hi >= lo && tf_lut[hi] == tf_table[hi])
+            hi--;
+        if(lo <= hi)
+        {
+            glTexSubImage1D(GL_TEXTURE_1D, 0, lo, hi - lo + 1, GL_RGBA, GL_FLOAT, &tf_table[lo]);
+            std::copy(tf_table.begin() + lo, tf_table.begin() + hi + 1, tf_lut.begin() + lo);
+        }
+        is_lut_changed = (lo <= hi);
+    }
+
+    //Empty space skipping and adaptive steps read the opacity range of the full LUT, not of the pre-integration resample.
+    if(is_lut_changed)
+    {
+        bool is_allocated = !opacity_range.table.empty();
+        opacity_range.build(tf_lut);
+        int n = opacity_range.size;
+        glActiveTexture(GL_TEXTURE9);
+        glBindTexture(GL_TEXTURE_2D, opacity_range_tex2D);
+        if(!is_allocated)
+        {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, n, n, 0, GL_RG, GL_FLOAT, opacity_range.table.data());
+        }
         else
-            delete[] (uint16_t*)volume_data;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, n, n, GL_RG, GL_FLOAT, opacity_range.table.data());
     }
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glActiveTexture(GL_TEXTURE1);
 
-    title = "File Loaded!";
-    msg = "File Loaded Successfully!";
+    //The pre-integration table is quadratic in the number of entries so it is built from a 256 entry resample of the LUT.
+    preint_source.resize(256);
+    for(int i = 0; i < preint_source.size(); i++)
+        preint_source[i] = tf_table[(int) std::round(i * (lut_size - 1) / 255.0f)];
+
+    is_dirty = true;
+    light_version++;
+    interaction_time = glfwGetTime();
+    int prev_size = preint_table.size;
+    if(!preint_table.update(preint_source))
+        return;
+
+    int n = preint_table.size, lo = preint_table.dirty_min, hi = preint_table.dirty_max;
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, preint_tex2D);
+    if(prev_size != n)
+    {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, n, n, 0, GL_RGBA, GL_FLOAT, preint_table.table.data());
+    }
+    else
+    {
+        //Changed segments form two rectangles, front <= hi with back >= lo and front >= lo with back <= hi.
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, n);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, lo, hi + 1, n - lo, GL_RGBA, GL_FLOAT, &preint_table.table[lo * n]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, lo, 0, n - lo, hi + 1, GL_RGBA, GL_FLOAT, &preint_table.table[lo]);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+    glActiveTexture(GL_TEXTURE1);
+}
 
-    if(!loaded_shader.empty())
+/* Called every frame. Restarts the occlusion job whenever something affecting the classified opacity changed, they bump
+ * light_version as well, and uploads the part of the result that changed once a job is done. Changes that leave the
+ * opacity of every raw value the same don't start a job.
+ */
+bool RendererCore::updateOcclusion()
+{
+    if(!use_occlusion || !volume_data || tf_lut.empty())
+        return false;
+
+    if(!is_occlusion_valid)
     {
-        setUniforms();
-        main_cam.resetCamera();
+        //The render thread may still be sampling the old texture.
+        render_thread.waitIdle();
+        occlusion.setup(volume_data, datasize_bytes, tex3D_dim, macrocells);
+        glActiveTexture(GL_TEXTURE8);
+        glBindTexture(GL_TEXTURE_3D, occlusion_tex3D);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, occlusion.dim.x, occlusion.dim.y, occlusion.dim.z, 0, GL_RED, GL_UNSIGNED_BYTE, occlusion.visibility.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glActiveTexture(GL_TEXTURE1);
+        is_occlusion_valid = true;
+        occlusion_version = -1;
     }
 
-    int idx = fn.find_last_of("/");
-    loaded_dataset =  fn.substr(idx+1, fn.length() - idx);
+    //Same classification as the raymarcher: window, linearly interpolated LUT, alpha_scale on the extinction.
+    if(occlusion_version != light_version)
+    {
+        occlusion_version = light_version;
+        int lut_size = tf_lut.size();
+        float window = std::max(1, render_state.max_val - render_state.min_val);
+        std::vector<float> opacity((datasize_bytes == 1) ? 256 : 65536);
+        for(int i = 0; i < opacity.size(); i++)
+        {
+            float pos = glm::clamp((i - render_state.min_val) / window, 0.0f, 1.0f) * (lut_size - 1);
+            int lo = std::min((int) pos, lut_size - 1), hi = std::min(lo + 1, lut_size - 1);
+            float alpha = tf_lut[lo].w + (tf_lut[hi].w - tf_lut[lo].w) * (pos - lo);
+            opacity[i] = (alpha_scale > 0.0f) ? 1.0f - std::pow(std::max(1.0f - alpha, 0.0f), alpha_scale) : 0.0f;
+        }
+        occlusion.update(opacity);
+    }
+
+    glm::ivec3 region_min, region_max;
+    if(!occlusion.poll(region_min, region_max))
+        return false;
+
+    glm::ivec3 size = region_max - region_min;
+    const uint8_t* data = &occlusion.visibility[((size_t)region_min.z * occlusion.dim.y + region_min.y) * occlusion.dim.x + region_min.x];
+    glActiveTexture(GL_TEXTURE8);
+    glBindTexture(GL_TEXTURE_3D, occlusion_tex3D);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, occlusion.dim.x);
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, occlusion.dim.y);
+    glTexSubImage3D(GL_TEXTURE_3D, 0, region_min.x, region_min.y, region_min.z, size.x, size.y, size.z, GL_RED, GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glActiveTexture(GL_TEXTURE1);
+    is_dirty = true;
+    return true;
+}
+
+bool RendererCore::updateStatistics()
+{
+    if(!volume_stats.poll())
+        return false;
+    applyStatistics(false);
+    return true;
 }
 
-bool RendererCore::createShader(std::string fn, bool reload)
+void RendererCore::applyStatistics(bool reset_window)
+{
+    // min/max val are shown in Hounsfield Units for 16 bit data
+    int offset = (datasize_bytes == 2) ? -1000 : 0;
+    int new_min = (datasize_bytes == 2) ? volume_stats.min_value : 0;
+    int new_max = (datasize_bytes == 2) ? volume_stats.max_value : 255;
+
+    //Only move the window ends the user hasn't touched yet.
+    if(reset_window || min_val == min_dataset_val + offset)
+        min_val = new_min + offset;
+    if(reset_window || max_val == max_dataset_val + offset)
+        max_val = new_max + offset;
+
+    min_dataset_val = new_min;
+    max_dataset_val = new_max;
+    histogram = volume_stats.histogram;
+
+    if(!reset_window)
+    {
+        setMinVal();
+        setMaxVal();
+    }
+}
+
+bool RendererCore::readShaderFile(std::string& fn, bool reload)
 {
-    std::string shader_data = "";
     std::streamoff len;
     std::ifstream file;
 
     if(reload)
-        fn = loaded_shader;
+        fn = loaded_shader_path;
 
     file.open(fn, std::ios::binary);
     if(!file.is_open())
@@ -470,8 +1406,21 @@ bool RendererCore::createShader(std::string fn, bool reload)
     len = file.tellg();
     file.seekg(0, std::ios::beg);
 
-    shader_data.resize(len);
-    file.read(&shader_data[0], len);
+    shader_source.resize(len);
+    file.read(&shader_source[0], len);
+    loaded_shader_path = fn;
+    return true;
+}
+
+bool RendererCore::createShader(const std::string& defines)
+{
+    //Permutation defines go right after the #version line which has to come first.
+    std::string shader_data = shader_source;
+    size_t version_end = (shader_data.compare(0, 8, "#version") == 0) ? shader_data.find('\n') : std::string::npos;
+    if(version_end != std::string::npos)
+        shader_data.insert(version_end + 1, defines);
+    else
+        shader_data.insert(0, defines);
 
     const GLchar* source = (const GLchar *) shader_data.c_str();
 
@@ -496,44 +1445,38 @@ bool RendererCore::createShader(std::string fn, bool reload)
         title = "Shader Error!";
         return false;
     }
-    int idx = fn.find_last_of("/");
-    loaded_shader = fn.substr(idx+1, fn.length() - idx);
     return true;
 }
 
-bool RendererCore::createShaderProgram()
+GLuint RendererCore::createShaderProgram()
 {
-    if(!cs_programID)
-        cs_programID = glCreateProgram();
-    glAttachShader(cs_programID, cs_ID);
+    GLuint program_ID = glCreateProgram();
+    glProgramParameteri(program_ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(program_ID, cs_ID);
 
-    glLinkProgram(cs_programID);
-    glDetachShader(cs_programID, cs_ID);
+    glLinkProgram(program_ID);
+    glDetachShader(program_ID, cs_ID);
     glDeleteShader(cs_ID);
 
     GLint isLinked = 0;
-    glGetProgramiv(cs_programID, GL_LINK_STATUS, &isLinked);
+    glGetProgramiv(program_ID, GL_LINK_STATUS, &isLinked);
     if(isLinked == GL_FALSE)
     {
         GLint max_length = 0;
-        glGetProgramiv(cs_programID, GL_INFO_LOG_LENGTH, &max_length);
+        glGetProgramiv(program_ID, GL_INFO_LOG_LENGTH, &max_length);
 
         std::vector<GLchar> infoLog(max_length);
-        glGetProgramInfoLog(cs_programID, max_length, &max_length, &infoLog[0]);
+        glGetProgramInfoLog(program_ID, max_length, &max_length, &infoLog[0]);
 
-        glDeleteProgram(cs_programID);
-        cs_programID = 0;
+        glDeleteProgram(program_ID);
 
         std::string err_log(infoLog.begin(), infoLog.end());
         std::cout << "\n" << err_log << std::endl;
 
         msg = "Failed to Link Program Object, detailed log is printed in console.";
         title = "Shader Error!";
-        return false;
+        return 0;
     }
-
-    title = "Shader Loaded!";
-    msg = "Shader Loaded Successfully!";
-    return true;
+    return program_ID;
 }
 
@@ -1,17 +1,21 @@
 #include "RendererGUI.h"
 #include "glm/vec2.hpp"
+#include <cstdio>
 #include <functional>
 #include <iostream>
 
 RendererGUI::RendererGUI(int window_width, int window_height, std::string title, bool is_fullscreen) :
-    glfw_manager(window_width, window_height, title, is_fullscreen)
+    glfw_manager(window_width, window_height, title, is_fullscreen), tf_table(4096)
 {
     profiler_shown = true;
     tools_shown = false;
     histogram_shown = false;
     HU_scale_shown = false;
     renderer_start = false;
-    mspf = mspk = 0.0f;
+    mspf = mspk = msp_blit = msp_ui = cpu_mspf = 0.0f;
+    target_fps = 60;
+    low_power_idle = true;
+    skipped_fps = cancelled_fps = 0;
     profiler_wheight = tools_wheight = 0;
 }
 
@@ -37,36 +41,46 @@ void RendererGUI::run()
 {
     volren.window_size = glm::vec2(glfw_manager.window_width, glfw_manager.window_height);
     volren.framebuffer_size = glm::vec2(glfw_manager.framebuffer_width, glfw_manager.framebuffer_height);
-    volren.setup();
+    volren.setup(glfw_manager.render_context);
 
     glfw_manager.setCameraUpdateCallback(std::bind(&(volren.main_cam.setOrientation), &volren.main_cam,
                                          std::placeholders::_1,
                                          std::placeholders::_2,
                                          std::placeholders::_3)
                                         );
+    glfw_manager.setFramebufferResizeCallback(std::bind(&RendererCore::resize, &volren,
+                                              std::placeholders::_1,
+                                              std::placeholders::_2)
+                                             );
     glfw_manager.focusWindow();
-    int frame_count = 0;
-    double prev_time = glfwGetTime(), prev_frame_time = 0, skip_ticks = 16.66666;
+    int frame_count = 0, ui_active_frames = 0;
+    double prev_time = glfwGetTime(), cpu_time_sum = 0;
 
     volren.loadShader("VolumeRenderer.cs", false);
     while(!glfwWindowShouldClose(glfw_manager.window))
     {
+        double frame_start = glfwGetTime();
+
         //Show ms per frame and per kernel averaged over 1 sec intervals...
-        if(glfwGetTime() - prev_time >= 1.0)
+        if(frame_count > 0 && frame_start - prev_time >= 1.0)
         {
-            mspf = (glfwGetTime() - prev_time) * 1000/frame_count;
-            mspk = (float) volren.kerneltime_sum / frame_count;
+            mspf = (frame_start - prev_time) * 1000/frame_count;
+            cpu_mspf = cpu_time_sum * 1000/frame_count;
+            mspk = volren.render_thread.getKernelTime();
+            volren.render_thread.resetKernelTime();
+            msp_blit = volren.gpu_timer.getAverage("blit");
+            msp_ui = volren.gpu_timer.getAverage("UI");
+            volren.gpu_timer.resetAverages();
+            skipped_fps = volren.skipped_frames;
+            cancelled_fps = volren.render_thread.cancelled_frames.exchange(0);
+            if(renderer_start)
+                volren.updateSampleStats();
             frame_count = 0;
-            volren.kerneltime_sum = 0;
-            prev_time = glfwGetTime();
+            cpu_time_sum = 0;
+            volren.skipped_frames = 0;
+            prev_time = frame_start;
         }
-
-        //Lock frame rate to 60 fps
-        if( (glfwGetTime() - prev_frame_time) * 1000 <= skip_ticks)
-            continue;
-
         frame_count++;
-        prev_frame_time = glfwGetTime();
 
         //Start Drawing a new frame
         glClearColor(0.3, 0.3, 0.3, 1.0);
@@ -97,12 +111,43 @@ void RendererGUI::run()
         }
         showMessageBox(error_title, error_msg);
 
+        if(volren.updateStatistics())
+            transfer_func.setHistogram(volren.histogram, true);
+        volren.updateOcclusion();
+
         if(renderer_start)
             volren.render();
 
+        volren.gpu_timer.begin("UI");
         renderFrame();
+        volren.gpu_timer.end("UI");
+        volren.gpu_timer.nextFrame();
+        cpu_time_sum += glfwGetTime() - frame_start;
         glfwSwapBuffers(glfw_manager.window);
-        glfwPollEvents();
+
+        /* Sleep until the next frame is due instead of spinning, input wakes the loop early. With nothing left to
+         * render the loop only wakes on input or on the empty event posted when a frame, the statistics refinement or
+         * an occlusion job finishes.
+         */
+        if(ui_active_frames > 0)
+            ui_active_frames--;
+        bool is_idle = low_power_idle && ui_active_frames == 0 && !(renderer_start && volren.hasPendingWork());
+        if(is_idle)
+        {
+            glfwWaitEvents();
+            ui_active_frames = 3;
+        }
+
+        //Frame pacing, events arriving before the deadline are handled but don't start a new frame yet.
+        double deadline = frame_start + 1.0 / target_fps;
+        double remaining = deadline - glfwGetTime();
+        if(remaining <= 0)
+            glfwPollEvents();
+        while(remaining > 0)
+        {
+            glfwWaitEventsTimeout(remaining);
+            remaining = deadline - glfwGetTime();
+        }
     }
 }
 
@@ -194,7 +239,10 @@ void RendererGUI::showMenu()
 
         //If pvm file was loaded or if raw file was loaded and raw.inf was present call readVolumeData immediately. Else ask user for information regarding data.
         if(ext == "pvm" || volren.checkRawInfFile(file_dialog.selected_fn))
+        {
             volren.readVolumeData(file_dialog.selected_fn);
+            transfer_func.setHistogram(volren.histogram, volren.volume_stats.is_exact);
+        }
         else
             open_inf_panel = true;
 
@@ -207,6 +255,7 @@ void RendererGUI::showMenu()
     if(showRawInfPanel())
     {
         volren.readVolumeData(file_dialog.selected_fn);
+        transfer_func.setHistogram(volren.histogram, volren.volume_stats.is_exact);
         if(!volren.loaded_shader.empty())
             enableToolsGUI();
     }
@@ -273,12 +322,12 @@ void RendererGUI::showProfiler()
         ImGui::Text("Workgroups in X");
         ImGui::SameLine();
         ImGui::SetCursorPosX(140);
-        ImGui::Text(": %d", volren.workgroups_x);
+        ImGui::Text(": %d / %d", volren.dispatched_x, volren.workgroups_x);
 
         ImGui::Text("Workgroups in Y");
         ImGui::SameLine();
         ImGui::SetCursorPosX(140);
-        ImGui::Text(": %d", volren.workgroups_y);
+        ImGui::Text(": %d / %d", volren.dispatched_y, volren.workgroups_y);
 
         ImGui::Text("Dataset");
         ImGui::SameLine();
@@ -296,6 +345,35 @@ void RendererGUI::showProfiler()
         ImGui::SetCursorPosX(ImGui::GetCursorPosX() - ImGui::GetStyle().ItemSpacing.x);
         ImGui::TextWrapped("%s", volren.loaded_shader.c_str());
 
+        ImGui::Text("Shader build");
+        ImGui::SameLine();
+        ImGui::SetCursorPosX(140);
+        ImGui::Text(": %.1f ms%s", volren.program_build_ms, (volren.is_program_cached) ? " (cached)" : "");
+
+        if(volren.volume_filter == volren.FILTER_CUBIC)
+        {
+            ImGui::Text("B-spline prefilter");
+            ImGui::SameLine();
+            ImGui::SetCursorPosX(140);
+            ImGui::Text(": %.1f ms", volren.prefilter_ms);
+        }
+
+        if(volren.use_shading && volren.use_shadows)
+        {
+            ImGui::Text("ms/light pass");
+            ImGui::SameLine();
+            ImGui::SetCursorPosX(140);
+            ImGui::Text(": %.2f ms", volren.render_thread.getLightTime());
+        }
+
+        if(volren.use_shading && volren.gradient_source == volren.GRADIENT_VOLUME)
+        {
+            ImGui::Text("Gradient volume");
+            ImGui::SameLine();
+            ImGui::SetCursorPosX(140);
+            ImGui::Text(": %.1f ms", volren.gradient_ms);
+        }
+
         ImGui::Text("ms/frame (capped)");
         ImGui::SameLine();
         ImGui::SetCursorPosX(140);
@@ -305,6 +383,41 @@ void RendererGUI::showProfiler()
         ImGui::SameLine();
         ImGui::SetCursorPosX(140);
         ImGui::Text(": %.2f ms", mspk);
+
+        ImGui::Text("CPU ms/frame");
+        ImGui::SameLine();
+        ImGui::SetCursorPosX(140);
+        ImGui::Text(": %.2f ms", cpu_mspf);
+
+        ImGui::Text("ms/blit");
+        ImGui::SameLine();
+        ImGui::SetCursorPosX(140);
+        ImGui::Text(": %.2f ms", msp_blit);
+
+        ImGui::Text("ms/UI");
+        ImGui::SameLine();
+        ImGui::SetCursorPosX(140);
+        ImGui::Text(": %.2f ms", msp_ui);
+
+        ImGui::Text("Render scale");
+        ImGui::SameLine();
+        ImGui::SetCursorPosX(140);
+        ImGui::Text(": %.0f%% (auto %.0f%%)", 100.0f / volren.render_scale, 100.0f / volren.dynamic_scale);
+
+        ImGui::Text("samples/ray");
+        ImGui::SameLine();
+        ImGui::SetCursorPosX(140);
+        ImGui::Text(": %.1f", volren.samples_per_ray);
+
+        ImGui::Text("skipped frames/s");
+        ImGui::SameLine();
+        ImGui::SetCursorPosX(140);
+        ImGui::Text(": %d", skipped_fps);
+
+        ImGui::Text("cancelled frames/s");
+        ImGui::SameLine();
+        ImGui::SetCursorPosX(140);
+        ImGui::Text(": %d", cancelled_fps);
         profiler_wheight = 35 + ImGui::GetWindowHeight();
         ImGui::End();
     }
@@ -316,7 +429,11 @@ void RendererGUI::showHistogram()
     ImGuiIO& io = ImGui::GetIO();
     ImGui::SetNextWindowPos(ImVec2(10,35), ImGuiCond_Once, ImVec2(0,0));
     ImGui::SetNextWindowSize(ImVec2(io.DisplaySize.x - 300, 0), ImGuiCond_Once);
-    transfer_func.render();
+    if(transfer_func.render())
+    {
+        transfer_func.bakeTable(tf_table);
+        volren.updateTransferFunction(tf_table);
+    }
     //ImGui::Begin("IsoValue Histogram##window");
     //ImGui::PlotHistogram("IsoValue Histogram", volren.histogram.data(), volren.histogram.size(), 0, NULL, 0.0f, 100.0f, ImVec2(ImGui::GetWindowSize().x -200,180));
     //ImGui::End();
@@ -339,6 +456,169 @@ void RendererGUI::showTools()
         showHelpMarker("Use Ctrl+Click to input value.");
         ImGui::PopItemWidth();
 
+        ImGui::PushItemWidth(130);
+        if(ImGui::SliderFloat("Sampling Rate", &volren.sampling_rate, 0.25f, 4.0f, "%.2f"))
+            volren.setSamplingRate();
+        ImGui::SameLine();
+        showHelpMarker("Samples per voxel along the ray. Lower values trade quality for speed.");
+        ImGui::PopItemWidth();
+
+        ImGui::PushItemWidth(130);
+        if(ImGui::Combo("Filtering", &volren.volume_filter, "Nearest\0" "Trilinear (HW)\0" "Trilinear (8-tap)\0" "Tricubic B-spline\0"))
+            volren.setVolumeFilter();
+        ImGui::PopItemWidth();
+        ImGui::SameLine();
+        showHelpMarker("Reconstruction between voxels. Trilinear (HW) uploads the volume as UNORM so the texture unit filters it, 8-tap interpolates the integer volume in the shader. Tricubic B-spline is smoother but takes 8 filtered fetches per sample and needs the volume prefiltered when selected. Compare their cost with ms/kernel.");
+
+        if(ImGui::Checkbox("Shading", &volren.use_shading))
+            volren.setShading();
+        ImGui::SameLine();
+        showHelpMarker("Blinn-Phong lighting from the volume gradient. Not used with MIP.");
+
+        if(volren.use_shading)
+        {
+            ImGui::PushItemWidth(130);
+            if(ImGui::Combo("Gradients", &volren.gradient_source, "Central Diff.\0" "Gradient Volume\0"))
+                volren.setShading();
+            ImGui::SameLine();
+            showHelpMarker("Central differences take 6 extra samples per shaded sample. The gradient volume is precomputed once, takes a single fetch but 3 bytes per voxel of video memory.");
+
+            if(volren.gradient_source == volren.GRADIENT_VOLUME)
+            {
+                if(ImGui::Combo("Gradient Kernel", &volren.gradient_kernel, "Central Diff.\0" "Sobel\0"))
+                    volren.setGradientKernel();
+                ImGui::SameLine();
+                showHelpMarker("Sobel smooths the gradient over the 26 neighbours, less noisy shading on CT and MRI data.");
+            }
+
+            if(ImGui::Checkbox("Shadows", &volren.use_shadows))
+                volren.setShading();
+            ImGui::SameLine();
+            showHelpMarker("Volumetric shadows from a half resolution light volume. It is swept slice by slice from the light when the light, transfer function or window change, camera moves reuse it.");
+
+            bool is_changed = ImGui::SliderFloat("Light Azimuth", &volren.light_azimuth, -180.0f, 180.0f, "%.0f deg");
+            is_changed |= ImGui::SliderFloat("Light Elevation", &volren.light_elevation, -90.0f, 90.0f, "%.0f deg");
+            is_changed |= ImGui::SliderFloat("Ambient", &volren.material.x, 0.0f, 1.0f, "%.2f");
+            is_changed |= ImGui::SliderFloat("Diffuse", &volren.material.y, 0.0f, 1.0f, "%.2f");
+            is_changed |= ImGui::SliderFloat("Specular", &volren.material.z, 0.0f, 1.0f, "%.2f");
+            is_changed |= ImGui::SliderFloat("Shininess", &volren.material.w, 1.0f, 128.0f, "%.0f");
+            is_changed |= ImGui::SliderFloat("Shading Threshold", &volren.shading_threshold, 0.0f, 0.2f, "%.3f");
+            if(is_changed)
+                volren.setLighting();
+            ImGui::PopItemWidth();
+            ImGui::SameLine();
+            showHelpMarker("Samples less opaque than the threshold are not shaded and skip the gradient computation.");
+        }
+
+        if(ImGui::Checkbox("Ambient Occlusion", &volren.use_occlusion))
+            volren.setOcclusion();
+        ImGui::SameLine();
+        showHelpMarker("Darken samples surrounded by opaque material. Computed in the background at half resolution, transfer function edits only update the affected regions.");
+
+        if(ImGui::TreeNode("Clipping"))
+        {
+            ImGui::PushItemWidth(130);
+            bool is_changed = ImGui::DragFloatRange2("Crop X", &volren.crop_min.x, &volren.crop_max.x, 0.005f, 0.0f, 1.0f, "%.3f", "%.3f", ImGuiSliderFlags_AlwaysClamp);
+            is_changed |= ImGui::DragFloatRange2("Crop Y", &volren.crop_min.y, &volren.crop_max.y, 0.005f, 0.0f, 1.0f, "%.3f", "%.3f", ImGuiSliderFlags_AlwaysClamp);
+            is_changed |= ImGui::DragFloatRange2("Crop Z", &volren.crop_min.z, &volren.crop_max.z, 0.005f, 0.0f, 1.0f, "%.3f", "%.3f", ImGuiSliderFlags_AlwaysClamp);
+
+            for(int i = 0; i < volren.max_clip_planes; i++)
+            {
+                RendererCore::ClipPlane& plane = volren.clip_planes[i];
+                ImGui::PushID(i);
+                char label[16];
+                snprintf(label, sizeof(label), "Plane %d", i + 1);
+                is_changed |= ImGui::Checkbox(label, &plane.is_enabled);
+                if(plane.is_enabled)
+                {
+                    is_changed |= ImGui::Combo("Orientation", &plane.orientation, "+X\0" "-X\0" "+Y\0" "-Y\0" "+Z\0" "-Z\0" "Custom\0");
+                    if(plane.orientation == 6)
+                    {
+                        is_changed |= ImGui::SliderFloat("Azimuth", &plane.azimuth, -180.0f, 180.0f, "%.0f deg");
+                        is_changed |= ImGui::SliderFloat("Elevation", &plane.elevation, -90.0f, 90.0f, "%.0f deg");
+                    }
+                    is_changed |= ImGui::SliderFloat("Offset", &plane.offset, -1.0f, 1.0f, "%.3f");
+                }
+                ImGui::PopID();
+            }
+            ImGui::PopItemWidth();
+
+            if(ImGui::Button("Reset Clipping"))
+                volren.resetClipping();
+            else if(is_changed)
+                volren.setClipping();
+            ImGui::SameLine();
+            showHelpMarker("The crop box and the enabled planes cut the ray before it is marched, removed parts of the volume cost nothing. Everything on the side the plane normal points to is clipped, the offset moves the plane from the center along its normal.");
+            ImGui::TreePop();
+        }
+
+        if(ImGui::Checkbox("Adaptive Steps", &volren.use_adaptive_sampling))
+            volren.setAdaptiveSampling();
+        ImGui::SameLine();
+        showHelpMarker("Take larger steps through nearly transparent or homogeneous regions.");
+
+        if(ImGui::Checkbox("Pre-Integrated TF", &volren.use_preintegration))
+            volren.setPreIntegration();
+        ImGui::SameLine();
+        showHelpMarker("Classify whole ray segments instead of single samples. Removes slab artifacts from sharp transfer functions at lower sampling rates.");
+
+        ImGui::Checkbox("Low-Res Interaction", &volren.use_interaction_lowres);
+        ImGui::SameLine();
+        showHelpMarker("Render at reduced resolution while the camera or transfer function is changing, then refine once idle.");
+
+        if(volren.use_interaction_lowres)
+        {
+            ImGui::PushItemWidth(130);
+            int scale_idx = (volren.use_dynamic_res) ? 2 : ((volren.interaction_scale == 4) ? 1 : 0);
+            if(ImGui::Combo("Resolution", &scale_idx, "1/2\0" "1/4\0" "Auto\0"))
+            {
+                volren.use_dynamic_res = (scale_idx == 2);
+                if(!volren.use_dynamic_res)
+                    volren.interaction_scale = (scale_idx == 1) ? 4 : 2;
+            }
+            if(volren.use_dynamic_res)
+            {
+                ImGui::SliderFloat("Kernel Budget", &volren.kernel_budget_ms, 4.0f, 50.0f, "%.0f ms");
+                ImGui::SameLine();
+                showHelpMarker("Target GPU time per frame while interacting, the resolution is lowered until frames fit.");
+            }
+            ImGui::SliderFloat("Refine Delay", &volren.refine_delay, 0.05f, 2.0f, "%.2f s");
+            ImGui::PopItemWidth();
+        }
+
+        ImGui::PushItemWidth(130);
+        int format_idx = (volren.target_format == GL_RGBA8) ? 2 : ((volren.target_format == GL_RGBA16F) ? 1 : 0);
+        if(ImGui::Combo("Target Format", &format_idx, "RGBA32F\0" "RGBA16F\0" "RGBA8\0"))
+        {
+            const GLenum formats[3] = {GL_RGBA32F, GL_RGBA16F, GL_RGBA8};
+            volren.target_format = formats[format_idx];
+            volren.setTargetFormat();
+        }
+        ImGui::PopItemWidth();
+        ImGui::SameLine();
+        showHelpMarker("Precision of the render targets. RGBA8 matches the window so the blit is a plain copy, but accumulated frames lose precision.");
+
+        ImGui::PushItemWidth(130);
+        ImGui::SliderFloat("Slice Budget", &volren.slice_budget_ms, 2.0f, 50.0f, "%.0f ms");
+        ImGui::PopItemWidth();
+        ImGui::SameLine();
+        showHelpMarker("GPU time per batch of screen tiles. Heavy frames are spread over several batches and shown while they fill in from the center.");
+
+        if(ImGui::Checkbox("Temporal Accumulation", &volren.use_temporal_accum))
+            volren.is_dirty = true;
+        ImGui::SameLine();
+        showHelpMarker("Jitter rays every frame and blend the frames while the view is still. Converges to a clean image even at low sampling rates.");
+
+        ImGui::PushItemWidth(130);
+        ImGui::SliderInt("Target FPS", &target_fps, 10, 240);
+        ImGui::PopItemWidth();
+        ImGui::SameLine();
+        showHelpMarker("Upper limit for the frame rate, the loop sleeps between frames.");
+
+        ImGui::Checkbox("Low Power Idle", &low_power_idle);
+        ImGui::SameLine();
+        showHelpMarker("Stop redrawing when nothing changes, the window wakes up on input.");
+
         if(ImGui::Checkbox("MIP", &volren.use_mip))
             volren.setMIP();
         ImGui::SameLine();
@@ -387,6 +667,13 @@ void RendererGUI::showHounsfieldScale()
         ImGui::SameLine();
         showHelpMarker("Use this to view a certain range of values. For 16 bit data the values recorded are probably in Hounsfield Units. Use the below table as reference for setting the range.");
 
+        if(!volren.volume_stats.is_exact)
+        {
+            ImGui::Text("Range from %d samples", volren.volume_stats.sample_count);
+            ImGui::Text("Histogram error < %.2f%% (95%%)", volren.volume_stats.error_bound * 100.0f);
+            ImGui::ProgressBar(volren.volume_stats.getRefineProgress(), ImVec2(-1, 0), "Refining...");
+        }
+
         ImGui::Separator();
 
         ImVec2 text_size = ImGui::CalcTextSize("Hounsfield Scale", NULL, true, 270);
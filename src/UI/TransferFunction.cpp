@@ -1,4 +1,5 @@
 #include "TransferFunction.h"
+#include "ParallelFor.h"
 #include "glm/vec2.hpp"
 #include "imgui/imgui.h"
 #include "imgui/imgui_internal.h"
@@ -7,6 +8,7 @@ TransferFunction::TransferFunction() : data_scale(DataScale::ADAPTIVE_SCALE), al
 {
     max_dataset_val = 255;
     min_medical_val = -1000;
+    is_histogram_exact = true;
     //ctor
 }
 
@@ -15,13 +17,40 @@ TransferFunction::~TransferFunction()
     //dtor
 }
 
-void TransferFunction::render()
+bool TransferFunction::render()
 {
     ImGui::ShowDemoWindow();
     ImGui::Begin("Transfer Function");
-    alpha_spline.render(300);
-    //grad_bar.render(30, 220);
+    if(!histogram.empty())
+    {
+        const char* overlay = (is_histogram_exact) ? NULL : "Approximate, refining...";
+        ImGui::PlotHistogram("##Histogram", histogram.data(), histogram.size(), 0, overlay, 0.0f, 100.0f, ImVec2(ImGui::GetContentRegionAvail().x, 80));
+    }
+    bool is_changed = alpha_spline.render(300);
+    is_changed |= grad_bar.render(30, 30);
     ImGui::End();
+    return is_changed;
+}
+
+void TransferFunction::bakeTable(std::vector<glm::vec4>& table)
+{
+    //Entry i covers the windowed value i/(size-1), which is i/(size-1) * 255 on the TF editor scale.
+    int size = table.size();
+    parallelFor(0, size, [&](int begin, int end)
+    {
+        for(int i = begin; i < end; i++)
+        {
+            float iso_value = i * 255.0f / (size - 1);
+            glm::vec4 color = grad_bar.getColor(iso_value);
+            table[i] = glm::vec4(color.x, color.y, color.z, alpha_spline.getOpacity(iso_value));
+        }
+    });
+}
+
+void TransferFunction::setHistogram(const std::vector<float>& histogram, bool is_exact)
+{
+    this->histogram = histogram;
+    is_histogram_exact = is_exact;
 }
 
 int TransferFunction::convertValue(DataScale to_scale, int value)
@@ -35,12 +35,13 @@ AlphaControlSplineWidget::~AlphaControlSplineWidget()
     //dtor
 }
 
-void AlphaControlSplineWidget::render(float height, float width)
+bool AlphaControlSplineWidget::render(float height, float width)
 {
     ImGuiWindow* win = ImGui::GetCurrentWindow();
     ImGuiStyle& style = ImGui::GetStyle();
     glm::vec2 init_cursor_pos = ImGui::GetCursorScreenPos();
 
+    bool is_changed = false;
     bool is_knot_hovered = false;
     bool snapping = false;
     int hovered_knot_idx = -1;
@@ -58,6 +59,7 @@ void AlphaControlSplineWidget::render(float height, float width)
         alpha_knots.push_back({"A4", 149, glm::vec4(0, 0, 0, 0.45)});
         alpha_knots.push_back({"A2", 255, glm::vec4(0, 0, 0, 1)});
         alpha_spline.calcCubicSpline(alpha_knots);
+        is_changed = true;
     }
 
     //Draw Graph Frame
@@ -144,6 +146,7 @@ void AlphaControlSplineWidget::render(float height, float width)
             alpha_knots[i].color.w = new_coordinate_point.y;
             alpha_knots[i].iso_value = new_coordinate_point.x;
             alpha_spline.calcCubicSpline(alpha_knots);
+            is_changed = true;
         }
     }
 
@@ -151,6 +154,7 @@ void AlphaControlSplineWidget::render(float height, float width)
     {
         alpha_knots.erase(alpha_knots.begin() + del_idx);
         alpha_spline.calcCubicSpline(alpha_knots);
+        is_changed = true;
     }
 
     //If Right Clicked inside graph, add a control point
@@ -186,6 +190,7 @@ void AlphaControlSplineWidget::render(float height, float width)
             });
 
             alpha_spline.calcCubicSpline(alpha_knots);
+            is_changed = true;
         }
     }
 
@@ -196,6 +201,23 @@ void AlphaControlSplineWidget::render(float height, float width)
         ImGui::Text(alpha_knots[i].label.c_str());
     }*/
 
+    return is_changed;
+}
+
+float AlphaControlSplineWidget::getOpacity(float iso_value)
+{
+    if(alpha_knots.size() < 2)
+        return 0.0f;
+
+    //Knots are sorted by iso value, find the segment containing iso_value.
+    int segment_idx = 0;
+    while(segment_idx < alpha_knots.size() - 2 && alpha_knots[segment_idx + 1].iso_value <= iso_value)
+        segment_idx++;
+
+    const CubicSpline::TransferFuncControlPoint& k0 = alpha_knots[segment_idx];
+    const CubicSpline::TransferFuncControlPoint& k1 = alpha_knots[segment_idx + 1];
+    float t = glm::clamp((iso_value - k0.iso_value) / (float)(k1.iso_value - k0.iso_value), 0.0f, 1.0f);
+    return glm::clamp(alpha_spline.getPointOnSpline(t, segment_idx).w, v_min.y, v_max.y);
 }
 
 glm::vec2 AlphaControlSplineWidget::getScaleRatioFromPoint(glm::vec2 v)
@@ -10,6 +10,7 @@
 GradientBarWidget::GradientBarWidget()
 {
     knots_frameID = 0;
+    active_knot = nullptr;
     color_knots.reserve(15);
     prev_width = -1.0f;
     //ctor
@@ -28,6 +29,7 @@ bool GradientBarWidget::render(float knot_frame_height, float gradient_height, f
     ImVec2 init_cursor_pos = ImGui::GetCursorPos();
     ImVec2 knot_frame_cursor_pos = init_cursor_pos + ImVec2(0, gradient_height + style.ItemSpacing.y);
     ImRect knot_frame_usable_bb;
+    bool is_changed = false;
 
     //min max values of the scale
     float v_min, v_max;
@@ -60,6 +62,7 @@ bool GradientBarWidget::render(float knot_frame_height, float gradient_height, f
         fixed_knot2_ID = ImGui::GetID("K2");
         color_knots.push_back({"K1", 0,  init_cursor_pos.x + knot_half_sz.x, IM_COL32_BLACK});
         color_knots.push_back({"K2", 255, init_cursor_pos.x + gradient_width - knot_half_sz.x, IM_COL32_WHITE});
+        is_changed = true;
     }
 
     v_min = color_knots[0].value;
@@ -91,6 +94,7 @@ bool GradientBarWidget::render(float knot_frame_height, float gradient_height, f
             int rel_max = color_knots[max_idx].value - 1;
             color_knots[i].value = getScaleValueFromPosition(ImGui::GetMousePos().x, knot_frame_usable_bb, v_min, v_max, rel_min, rel_max);
             color_knots[i].pos_x = getKnotRectFromValue(knot_frame_usable_bb, color_knots[i].value, v_min, v_max).GetCenter().x;
+            is_changed = true;
         }
     }
 
@@ -129,9 +133,30 @@ bool GradientBarWidget::render(float knot_frame_height, float gradient_height, f
             {
                 return a.pos_x < b.pos_x;
             });
+            is_changed = true;
         }
     }
     list_splitter.Merge(win->DrawList);
+    return is_changed;
+}
+
+ImVec4 GradientBarWidget::getColor(float value)
+{
+    if(color_knots.empty())
+        return ImVec4(value / 255.0f, value / 255.0f, value / 255.0f, 1.0f);
+
+    //Linear interpolation between the two knots around value, same as the gradient bar drawn above.
+    if(value <= color_knots[0].value)
+        return ImGui::ColorConvertU32ToFloat4(color_knots[0].color);
+    for(int i = 1; i < color_knots.size(); i++)
+    {
+        if(value <= color_knots[i].value)
+        {
+            float t = (value - color_knots[i-1].value) / (float)(color_knots[i].value - color_knots[i-1].value);
+            return ImLerp(ImGui::ColorConvertU32ToFloat4(color_knots[i-1].color), ImGui::ColorConvertU32ToFloat4(color_knots[i].color), t);
+        }
+    }
+    return ImGui::ColorConvertU32ToFloat4(color_knots.back().color);
 }
 
 ImRect GradientBarWidget::getKnotRectFromValue(ImRect knot_frame_bb, int v, int v_min, int v_max)
@@ -0,0 +1,186 @@
+#include "VolumeStatistics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace
+{
+    const int num_samples = 65536;
+    const size_t refine_chunk = 1 << 22;
+}
+
+VolumeStatistics::VolumeStatistics() : histogram(256, 0.0f), cancel_refine(false), is_refined(false), refine_progress(1.0f)
+{
+    min_value = max_value = 0;
+    sample_count = 0;
+    error_bound = 0.0f;
+    is_exact = true;
+}
+
+VolumeStatistics::~VolumeStatistics()
+{
+    cancel();
+}
+
+void VolumeStatistics::cancel()
+{
+    cancel_refine = true;
+    if(refine_thread.joinable())
+        refine_thread.join();
+    cancel_refine = false;
+    is_refined = false;
+}
+
+float VolumeStatistics::getRefineProgress()
+{
+    return refine_progress;
+}
+
+int VolumeStatistics::getVoxel(const uint8_t* data, int datasize_bytes, size_t idx)
+{
+    if(datasize_bytes == 1)
+        return data[idx];
+    else
+        return ((const uint16_t*) data)[idx];
+}
+
+int VolumeStatistics::getBin(int value, int datasize_bytes, int max_value)
+{
+    //16 bit values are scaled to 0-255 range, same as the TF editor
+    if(datasize_bytes == 1 || max_value <= 0)
+        return std::min(value, 255);
+    return std::min((int) std::round(value * 255.0f/max_value), 255);
+}
+
+void VolumeStatistics::normalizeHistogram(std::vector<float>& histogram)
+{
+    float max_count = 0;
+    for(int i = 0; i < histogram.size(); i++)
+        max_count = std::max(max_count, histogram[i]);
+
+    if(max_count > 0)
+    {
+        for(int i = 0; i < histogram.size(); i++)
+            histogram[i] = histogram[i] * 100.0f / max_count;
+    }
+}
+
+void VolumeStatistics::compute(std::shared_ptr<const std::vector<uint8_t>> volume_data, int datasize_bytes)
+{
+    cancel();
+
+    const uint8_t* data = volume_data->data();
+    size_t len = volume_data->size() / datasize_bytes;
+    if(len == 0)
+        return;
+
+    /* Stratified sampling, the volume is split into equally sized strata in memory order and one voxel is picked at random
+     * from each. This keeps the sample spread over all slices while still being random inside every stratum.
+     */
+    size_t strata = std::min(len, (size_t) num_samples);
+    size_t stratum_len = len / strata;
+    std::vector<int> samples(strata);
+    std::minstd_rand rng(1337);
+
+    min_value = 9000000;
+    max_value = -1;
+    for(size_t i = 0; i < strata; i++)
+    {
+        size_t idx = i * stratum_len;
+        if(stratum_len > 1)
+            idx += rng() % stratum_len;
+        samples[i] = getVoxel(data, datasize_bytes, idx);
+        min_value = std::min(min_value, samples[i]);
+        max_value = std::max(max_value, samples[i]);
+    }
+
+    std::fill(histogram.begin(), histogram.end(), 0.0f);
+    for(int i = 0; i < samples.size(); i++)
+    {
+        int bin = getBin(samples[i], datasize_bytes, max_value);
+        if(bin != 0)
+            histogram[bin]++;
+    }
+    normalizeHistogram(histogram);
+
+    sample_count = strata;
+    is_exact = (strata == len);
+
+    //Dvoretzky-Kiefer-Wolfowitz bound for the empirical distribution at 95% confidence
+    error_bound = (is_exact) ? 0.0f : std::sqrt(std::log(2.0f/0.05f) / (2.0f * strata));
+    if(is_exact)
+        return;
+
+    refine_progress = 0.0f;
+    refine_thread = std::thread(&VolumeStatistics::refine, this, volume_data, datasize_bytes);
+}
+
+void VolumeStatistics::refine(std::shared_ptr<const std::vector<uint8_t>> volume_data, int datasize_bytes)
+{
+    const uint8_t* data = volume_data->data();
+    size_t len = volume_data->size() / datasize_bytes;
+    Result res;
+    res.min_value = 9000000;
+    res.max_value = -1;
+    res.histogram.assign(256, 0.0f);
+
+    //First pass finds the range used to scale the bins, second pass fills them. Progress is split evenly between both.
+    for(size_t start = 0; start < len; start += refine_chunk)
+    {
+        if(cancel_refine)
+            return;
+        size_t end = std::min(len, start + refine_chunk);
+        for(size_t i = start; i < end; i++)
+        {
+            int val = getVoxel(data, datasize_bytes, i);
+            res.min_value = std::min(res.min_value, val);
+            res.max_value = std::max(res.max_value, val);
+        }
+        refine_progress = 0.5f * end / len;
+    }
+
+    for(size_t start = 0; start < len; start += refine_chunk)
+    {
+        if(cancel_refine)
+            return;
+        size_t end = std::min(len, start + refine_chunk);
+        for(size_t i = start; i < end; i++)
+        {
+            int bin = getBin(getVoxel(data, datasize_bytes, i), datasize_bytes, res.max_value);
+            if(bin != 0)
+                res.histogram[bin]++;
+        }
+        refine_progress = 0.5f + 0.5f * end / len;
+    }
+    normalizeHistogram(res.histogram);
+    setResult(res);
+}
+
+void VolumeStatistics::setResult(Result& res)
+{
+    {
+        std::lock_guard<std::mutex> lock(result_mutex);
+        refined_result = std::move(res);
+        is_refined = true;
+    }
+    if(on_refined)
+        on_refined();
+}
+
+bool VolumeStatistics::poll()
+{
+    if(!is_refined)
+        return false;
+
+    refine_thread.join();
+    std::lock_guard<std::mutex> lock(result_mutex);
+    histogram = std::move(refined_result.histogram);
+    min_value = refined_result.min_value;
+    max_value = refined_result.max_value;
+    is_exact = true;
+    error_bound = 0.0f;
+    refine_progress = 1.0f;
+    is_refined = false;
+    return true;
+}